@@ -17,6 +17,12 @@
 #include<complex>
 #include<thread>
 #include<atomic>
+#include<mutex>
+#include<memory>
+#include<tuple>
+#include<cstdint>
+#include<cstdio>
+#include<charconv>
 #include<unistd.h>
 
 #include<Lon2180.hpp>
@@ -24,6 +30,8 @@
 
 #define _TURNINGANGLE 89.999
 #define _RE 6371
+#define _RAYBUNDLE 8
+#define _TWOPOINTITER 50
 
 // Define the ray node.
 class Ray {
@@ -32,6 +40,9 @@ class Ray {
         std::string Comp,Debug;
         int InRegion,Prev,RemainingLegs,Surfacing,Color;
         double Pt,Pr,TravelTime,TravelDist,RayP,Amp,Inc,Takeoff;
+        std::vector<std::string> Merged; // lineages of coincident rays merged into this one.
+        std::string Branch;                    // "<input ray index>:" followed by t/d/r/s (ts/td/rd/rs) for each generation.
+        std::vector<std::string> MergedBranch; // branch codes of coincident rays merged into this one.
 
         Ray()=default;
         Ray(bool p, bool g, bool l, std::string cmp,
@@ -41,20 +52,396 @@ class Ray {
             Pt(th),Pr(r),TravelTime(t),TravelDist(d), RayP(rp), Amp(1),Inc(0), Takeoff(to) {}
 };
 
+// Cache of "RayPath" results in the 1D reference region (region 0).
+// A leg there only depends on (wave type, rayp, top depth, bottom depth), its starting theta and
+// left/right direction are applied afterwards. The key rayp is rounded to "RaypInc" (0 means exact).
+class LegCache {
+    public:
+        class Leg {
+            public:
+                std::vector<double> Degree;
+                std::size_t LastRadiusIndex;
+                std::pair<std::pair<double,double>,bool> Ans;
+        };
+
+        double RaypInc;
+
+        LegCache(double inc=0) : RaypInc(inc) {}
+
+        // The rayp actually used for tracing (and as part of the key).
+        double keyRayp(const double &rayp) const {
+            return (RaypInc>0?std::round(rayp/RaypInc)*RaypInc:rayp);
+        }
+
+        std::shared_ptr<const Leg> find(bool isP, double rayp, double top, double bot) {
+            std::lock_guard<std::mutex> lck(Mtx);
+            auto it=Legs.find(std::make_tuple(isP,keyRayp(rayp),top,bot));
+            return (it==Legs.end()?nullptr:it->second);
+        }
+
+        void insert(bool isP, double rayp, double top, double bot, std::shared_ptr<const Leg> leg) {
+            std::lock_guard<std::mutex> lck(Mtx);
+            Legs.emplace(std::make_tuple(isP,keyRayp(rayp),top,bot),leg);
+        }
+
+    private:
+        std::mutex Mtx;
+        std::map<std::tuple<bool,double,double,double>,std::shared_ptr<const Leg>> Legs;
+};
+
+// Coincident ray merging: quantized ray state --> index in "RayHeads". Guarded by "Mtx".
+class MergeMap : public std::map<std::vector<long long>,std::size_t> {
+    public:
+        std::mutex Mtx;
+};
+
+// A batch of input rays and the tracing options.
+class TraceBatch {
+    public:
+        std::vector<int> initRaySteps,initRayComp,initRayColor;
+        std::vector<double> initRayTheta,initRayDepth,initRayTakeoff;
+
+        bool TS=true,TD=true,RS=true,RD=true,DebugInfo=false,StopAtSurface=true;
+        std::size_t nThread=1;
+        bool UseLegCache=false,MergeRays=false,Wavefront=false;
+        double LegCacheRaypInc=0,MergeTolerance=1e-6;
+        std::size_t BeamWidth=0,RayBundle=0,TwoPass=0;
+        int LayerIntegrator=0;
+        std::size_t RayNumberOffset=0; // ray numbers in the outputs start from RayNumberOffset+1.
+        int OutputPrecision=6;         // significant digits in the text results. (see "TextWriter")
+
+        // Options affecting the results. (everything except the input rays, "nThread" and "RayNumberOffset")
+        std::tuple<bool,bool,bool,bool,bool,bool,bool,bool,bool,double,double,std::size_t,std::size_t,std::size_t,int,int> options() const {
+            return std::make_tuple(TS,TD,RS,RD,DebugInfo,StopAtSurface,UseLegCache,MergeRays,Wavefront,
+                                   LegCacheRaypInc,MergeTolerance,BeamWidth,RayBundle,TwoPass,LayerIntegrator,OutputPrecision);
+        }
+};
+
+// A leg of a ray train reaching the surface. (for travel-time perturbation)
+class ArrivalLeg {
+    public:
+        int Region;
+        bool IsP;
+        double TravelTime;
+};
+
+// A ray train reaching the surface, as numbers: the fields of its receiver file line. (see "TraceResult::ReachSurfaces")
+class SurfaceArrival {
+    public:
+        double Takeoff=0,RayP=0,Inc=0,Dist=0,TravelTime=0,Amp=0; // "Dist" is the surfacing theta (deg), as in <Dist>.
+        std::string Phase;                                        // <WaveTypeTrain>.
+};
+
+// An arrival of the receiver gather, as numbers. (see "ReceiverGather")
+class GatherArrival {
+    public:
+        std::size_t Station=0;                                   // index in the station list.
+        double SourceTheta=0,SourceDepth=0;
+        SurfaceArrival Arrival;                                   // interpolated at the station, "Dist" is the station distance.
+};
+
+// A two-point tracing target: arrivals of "Phase" (a <WaveTypeTrain>, e.g. "S->s") from the source at ("Theta","Depth"),
+// reaching the surface at "Distance" (deg, from the source, positive towards increasing theta).
+// Takeoff angles are searched between "Takeoff1" and "Takeoff2".
+class TwoPointTarget {
+    public:
+        std::string Name,Phase;
+        int Comp,Steps;
+        double Theta,Depth,Distance,Takeoff1,Takeoff2;
+};
+
+// An adaptive takeoff fan: rays from the source at ("Theta","Depth") between "Takeoff1" and "Takeoff2", starting at "Step" apart.
+class TakeoffFan {
+    public:
+        int Comp,Color,Steps;
+        double Theta,Depth,Takeoff1,Takeoff2,Step;
+};
+
+// A smooth anomaly in the 1D reference region: velocities and density are scaled by 1+d/100*exp(-x*x/2-y*y/2),
+// x=(theta-Theta)/ThetaWidth, y=(depth-Depth)/DepthWidth (deg, km; the widths are standard deviations), d is "dVp",
+// "dVs" or "dRho" (%). Overlapping anomalies add up. Only the adaptive-step integrator ("LayerIntegrator" 2) traces them.
+class SmoothAnomaly {
+    public:
+        double Theta,Depth,ThetaWidth,DepthWidth,dVp,dVs,dRho;
+};
+
+// Text output without iostreams: numbers are formatted by "std::to_chars" and appended to "Buffer". With a file, the
+// buffer is written out in large blocks. "Precision" is the number of significant digits (as "%g", 6 gives the same text
+// as the ostream default), 0 means the shortest form that reads back to the same double. With "Format" set to
+// std::chars_format::scientific, "Precision" is the digits after the decimal point instead (as "%.7e").
+class TextWriter {
+    public:
+        std::string Buffer;
+        int Precision=6;
+        std::chars_format Format=std::chars_format::general;
+
+        TextWriter(const int &precision=6) : Precision(precision) {}
+        TextWriter(const std::string &file, const int &precision=6);
+        TextWriter(const TextWriter &)=delete;
+        TextWriter &operator=(const TextWriter &)=delete;
+        ~TextWriter();
+
+        TextWriter &operator<<(const double &x);
+        TextWriter &operator<<(const int &x) {return integer(x);}
+        TextWriter &operator<<(const long &x) {return integer(x);}
+        TextWriter &operator<<(const long long &x) {return integer(x);}
+        TextWriter &operator<<(const unsigned long &x) {return integer(x);}
+        TextWriter &operator<<(const unsigned long long &x) {return integer(x);}
+        TextWriter &operator<<(const char &c) {Buffer.push_back(c);return spill();}
+        TextWriter &operator<<(const char *s) {Buffer.append(s);return spill();}
+        TextWriter &operator<<(const std::string &s) {Buffer.append(s);return spill();}
+
+        // Write out the rest and close the file. Throws if anything failed.
+        void close();
+
+    private:
+        FILE *File=nullptr;
+        std::string FileName;
+        bool Failed=false;
+
+        template<class T> TextWriter &integer(const T &x) {
+            char s[24];
+            Buffer.append(s,std::to_chars(s,s+sizeof(s),x).ptr);
+            return spill();
+        }
+        TextWriter &spill() {
+            if (File!=nullptr && Buffer.size()>=(1<<20)) write();
+            return *this;
+        }
+        void write();
+};
+
+// Header of a ray path, as numbers. (for the binary ray path file)
+// File layout (see "SaveRayPaths"): 4 uint64 {magic "RAYPATHS", version, nLeg, nPoint}, nLeg leg records of 8 int64/double
+// {id, parent id (0: none), color, type (0/1/2: P/SV/SH), travel time (sec), DispAmp, offset, count} where id is the ray
+// number (as in "<RayFilePrefix><id>") and the path is theta/radius[offset,offset+count), then float64 theta[nPoint] and
+// float64 radius[nPoint]. Every leg is at a fixed offset, so the file can be mmap-ed.
+class PathHeader {
+    public:
+        int Parent=-1,Color=0,Type=0;                  // index (0-based) of the previous leg in "RayHeads" (-1: none), color, 0/1/2 for P/SV/SH.
+        double TravelTime=0,Amp=0;
+};
+
+// Tracing results, indexed by ray number (position in "RayHeads"). Empty entries mean no output for that ray.
+class TraceResult {
+    public:
+        std::vector<std::string> ReachSurfaces,RayInfo;            // receiver file line, ray path header.
+        std::vector<std::vector<double>> RaysTheta,RaysRadius;     // ray path.
+        std::vector<std::pair<double,double>> BeamDiscarded;       // beam search: discarded/total |Amp| per generation.
+        std::vector<std::vector<ArrivalLeg>> ArrivalLegs;          // legs of the ray train, if it reaches the surface.
+        std::vector<std::string> ArrivalBranch;                    // branch code ("Ray::Branch") of the arrival.
+        std::vector<SurfaceArrival> Arrivals;                      // the arrival, as numbers. (full precision)
+        std::vector<PathHeader> PathHeaders;                       // ray path header, as numbers.
+
+        TraceResult(std::size_t n=0) : ReachSurfaces(n), RayInfo(n), RaysTheta(n), RaysRadius(n), ArrivalLegs(n), ArrivalBranch(n),
+                                       Arrivals(n), PathHeaders(n) {}
+};
+
+// Travel-time table: for each phase, source depth and distance, {travel time (sec), rayp (sec/deg), incident angle (deg)}
+// of the first arrival. NaN means no arrival.
+// File layout (see "SaveTravelTimeTable"): 6 uint64 {magic "RAYTABLE", version, nPhase, nDepth, nDist, nField=3},
+// 5 double {Theta, Depth1, DepthInc, Dist1, DistInc}, nPhase phase names (32 chars each, zero padded),
+// then the float32 "Data". The record of (phase,depth,distance) is at a fixed offset, so the file can be mmap-ed.
+class TravelTimeTable {
+    public:
+        double Theta=0,Depth1=0,DepthInc=0,Dist1=0,DistInc=0;  // source theta, source depths and distances (deg) axes.
+        std::size_t nDepth=0,nDist=0;
+        std::vector<std::string> Phases;                        // <WaveTypeTrain>, e.g. "S->s".
+        std::vector<float> Data;                                // [phase][depth][distance][field].
+
+        float *at(const std::size_t &phase, const std::size_t &depth, const std::size_t &dist) {
+            return Data.data()+((phase*nDepth+depth)*nDist+dist)*3;
+        }
+};
+
+// Results of the previous incremental trace. (see "Tracer::trace(Batch,History)")
+class TraceHistory {
+    public:
+        TraceBatch Batch;                            // the previous batch.
+        TraceResult Out;                             // the outputs.
+        std::vector<std::vector<std::size_t>> Slots; // positions of each input ray's legs in "Out".
+
+        // The model these results came from.
+        std::uint64_t LayerKey=0;
+        std::vector<std::vector<std::pair<double,double>>> Regions;
+        std::vector<std::vector<double>> RegionBounds;
+        std::vector<double> dVp,dVs,dRho;
+};
+
+// A preprocessed model. Construct it once, then trace any number of batches.
+// "trace" doesn't modify the model, so concurrent calls are safe.
+class Tracer {
+    public:
+        // "sourceDepths" are only used by the adaptive grid (refined around these depths).
+        Tracer(const std::vector<double> &gridDepth1,const std::vector<double> &gridDepth2,const std::vector<double> &gridInc,
+               const std::vector<double> &specialDepths,const std::vector<std::vector<double>> &Deviation,
+               const std::vector<std::vector<double>> &regionProperties,
+               const std::vector<std::vector<double>> &regionPolygonsTheta,
+               const std::vector<std::vector<double>> &regionPolygonsDepth,
+               const double &RectifyLimit, const double &AdaptiveGridMargin=0, const double &AdaptiveGridInc=0,
+               const std::vector<double> &sourceDepths={}, const std::size_t &nThread=1,
+               const std::string &ModelCachePrefix="NONE", const std::vector<SmoothAnomaly> &Anomalies={});
+
+        TraceResult trace(const TraceBatch &Batch) const;
+
+        // Incremental tracing: the outputs are kept in "History", and returned (valid until the next call on "History").
+        // The first call is a plain "trace(Batch)". On later calls with the same options, input rays unchanged from the
+        // previous call (same line in "Batch") keep their legs and ray numbers. The others are traced alone and spliced in:
+        // their legs take the ray numbers of their previous legs first, then unused ones, so an input ray's ray numbers
+        // are not in tracing order, and differ from what "trace(Batch)" would give. (<RayTrain> follows the new numbers)
+        // "History" may come from another Tracer (an edited model): if the 1D reference layers are the same, only input rays
+        // with a leg inside the old or new bounds of an edited region are traced again.
+        // Everything is traced again when the options or 1D layers change, when most input rays changed, or with "MergeRays"
+        // (merged rays tie input rays together). Beam search is not supported.
+        const TraceResult &trace(const TraceBatch &Batch, TraceHistory &History) const;
+
+        // Scenario: trace with region "region" (1 ~ number of polygons) replaced by a new polygon and properties (in %).
+        // Only this region is rebuilt; the rectified new polygon is returned in "Rectified".
+        TraceResult trace(const TraceBatch &Batch, const std::size_t &region, const std::vector<double> &properties,
+                          const std::vector<double> &polygonTheta, const std::vector<double> &polygonDepth,
+                          std::vector<std::pair<double,double>> &Rectified) const;
+
+        // First-order travel-time update for new polygon properties (same shape as "regionProperties", in %).
+        // Ray paths are kept fixed, so the travel time of a leg in region k scales by dV[k]/newdV[k].
+        // Returns the updated travel time of each arrival in "Out" (0 for rays not reaching the surface).
+        // "Refresh" marks arrivals with a leg in a region whose velocity changed by more than "Threshold" (relative):
+        // these should be traced again.
+        std::vector<double> perturb(const TraceResult &Out, const std::vector<std::vector<double>> &regionProperties,
+                                    const double &Threshold, std::vector<bool> &Refresh) const;
+
+        // Two-point tracing: for each target, "nScan" takeoff angles from "Takeoff1" to "Takeoff2" are traced (one input ray
+        // each, options from "Batch"). Every sign change of (distance - target distance) between neighbouring samples where
+        // the phase exists is refined by secant steps (bisection when the bracket doesn't halve), until the arrival lands
+        // within "Tolerance" (deg) of the target. A bracket that doesn't converge (the phase disappears inside, or distance
+        // jumps across the target, e.g. chord-grid steps of "RayPath"; or _TWOPOINTITER steps) gives its closest arrival.
+        // Returns {misfit (deg), receiver line} of each arrival, sorted by takeoff; |misfit|>"Tolerance" marks a bracket
+        // that didn't converge. Targets are solved on "Batch.nThread" threads.
+        std::vector<std::vector<std::pair<double,std::string>>> solve(const TraceBatch &Batch, const std::vector<TwoPointTarget> &Targets,
+                                                                      const std::size_t &nScan, const double &Tolerance) const;
+
+        // Adaptive takeoff fan: the initial fan is traced (one input ray each, options from "Batch"), then each interval whose
+        // two rays differ is split in half, until intervals are no wider than "MinStep". Two rays differ if their arrivals have
+        // different phase lineages (<WaveTypeTrain> and the regions of each leg), or a lineage surfaces more than "Tolerance"
+        // (deg) apart. Each round of new rays is traced on "Batch.nThread" threads. Returns the takeoff angles, sorted.
+        std::vector<double> fan(const TraceBatch &Batch, const TakeoffFan &Fan, const double &Tolerance, const double &MinStep) const;
+
+        // Travel-time table: fills "Table.Data" for the axes set in "Table".
+        // For each phase and source depth, takeoffs "Takeoff1" ~ "Takeoff2" every "TakeoffInc" are traced (component
+        // "Comps[phase]", "Steps[phase]" steps, other options from "Batch"). Arrivals of each lineage are split into monotone
+        // branches (see "MonotoneBranches") and interpolated onto the distance grid; the earliest arrival is kept.
+        // The (phase, depth) jobs run on "Batch.nThread" threads.
+        void tabulate(const TraceBatch &Batch, const std::vector<int> &Comps, const std::vector<int> &Steps,
+                      const double &Takeoff1, const double &Takeoff2, const double &TakeoffInc, TravelTimeTable &Table) const;
+
+        // First-arrival times from a source at ("Theta","Depth"), solving the eikonal equation by fast marching on a polar grid:
+        // theta every "ThetaInc" (deg, 0 ~ 360, periodic), radius every "RadiusInc" (km, from the surface towards the center).
+        // Velocities (P if "IsP", otherwise S) come from the same model as the ray tracer: the 1D reference layers times the
+        // polygon that contains the node (or the smooth anomalies, in the 1D reference region). Only the first arrival of this
+        // wave type, no conversions. Zero velocities (S in the outer core) block the wave.
+        // Returns the times (sec, infinity if not reached), [radius index][theta index].
+        std::vector<std::vector<double>> eikonal(const double &Theta, const double &Depth, const bool &IsP,
+                                                 const double &ThetaInc, const double &RadiusInc) const;
+
+        // Rectified polygons. (Regions[0] is the 1D reference, empty)
+        const std::vector<std::vector<std::pair<double,double>>> &regions() const {return Regions;}
+
+    private:
+        std::vector<double> specialDepths;
+        std::vector<std::vector<double>> Deviation;
+        std::vector<double> R,Vp,Vs,Rho,dVp,dVs,dRho;
+        std::vector<std::vector<std::pair<double,double>>> Regions;
+        std::vector<std::vector<double>> RegionBounds;
+        std::vector<SmoothAnomaly> Anomalies;
+        std::uint64_t LayerKey;  // hash of the 1D reference layers, special depths, 1D deviations and smooth anomalies.
+        double RectifyLimit;
+
+        TraceResult traceModel(const TraceBatch &Batch,
+                               const std::vector<std::vector<std::pair<double,double>>> &Regions,
+                               const std::vector<std::vector<double>> &RegionBounds,
+                               const std::vector<double> &dVp, const std::vector<double> &dVs, const std::vector<double> &dRho) const;
+};
+
 // Declarations.
+void PREMTabulated(const double &depth, double &vp, double &vs, double &rho);
 std::vector<double> MakeRef(const double &depth,const std::vector<std::vector<double>> &dev);
+void MakeRefLayers(const std::vector<double> &R, const std::vector<std::vector<double>> &dev,
+                   std::vector<double> &Vp, std::vector<double> &Vs, std::vector<double> &Rho, const std::size_t &nThread);
 std::size_t findClosetLayer(const std::vector<double> &R, const double &r);
 std::size_t findClosetDepth(const std::vector<double> &D, const double &d);
+void findLegLayers(const std::vector<double> &r, const double &MinDepth, const double &MaxDepth, std::size_t &first, std::size_t &last);
+void findLegDepths(const Ray &ray, const std::vector<double> &specialDepths, const std::vector<std::vector<double>> &RegionBounds,
+                   double &Top, double &Bot);
+void RayPathBundle(const std::vector<double> &r, const std::vector<double> &v, const double *rayp, const std::size_t &n,
+                   const double &MinDepth, const double &MaxDepth, LegCache::Leg *legs, const double &TurningAngle);
+std::pair<std::pair<double,double>,bool> RayPathGradient(const std::vector<double> &r, const std::vector<double> &v,
+                                                         const double &rayp, const double &MinDepth, const double &MaxDepth,
+                                                         std::vector<double> &degree, std::size_t &radius, const double &TurningAngle);
+double AnomalyScale(const std::vector<SmoothAnomaly> &Anomalies, const int &Property, const double &theta, const double &r,
+                    double *dTheta=nullptr, double *dR=nullptr);
+std::pair<std::pair<double,double>,bool> RayPathSmooth(const std::vector<double> &r, const std::vector<double> &v, const double &scale,
+                                                       const std::vector<SmoothAnomaly> &Anomalies, const int &Property,
+                                                       const double &Pt, const double &Pr, const bool &GoUp, const bool &GoLeft,
+                                                       double &rayp, const double &MinDepth, const double &MaxDepth,
+                                                       std::vector<double> &degree, std::size_t &radius, std::vector<double> &Velocity);
+std::pair<std::pair<double,double>,bool> tracePath(const int &LayerIntegrator, const std::vector<double> &r, const std::vector<double> &v,
+                                                   const double &scale, const double &rayp, const double &MinDepth, const double &MaxDepth,
+                                                   std::vector<double> &degree, std::size_t &radius);
+std::string ModelCacheFile(
+    const std::string &ModelCachePrefix, const std::vector<double> &initRayDepth,
+    const std::vector<double> &gridDepth1,const std::vector<double> &gridDepth2,const std::vector<double> &gridInc,
+    const std::vector<double> &specialDepths,const std::vector<std::vector<double>> &Deviation,
+    const std::vector<std::vector<double>> &regionProperties,
+    const std::vector<std::vector<double>> &regionPolygonsTheta,
+    const std::vector<std::vector<double>> &regionPolygonsDepth,
+    const double &RectifyLimit, const double &AdaptiveGridMargin, const double &AdaptiveGridInc, std::uint64_t &key);
+bool LoadModelCache(
+    const std::string &file, const std::uint64_t &key,
+    std::vector<double> &R, std::vector<double> &Vp, std::vector<double> &Vs, std::vector<double> &Rho,
+    std::vector<std::vector<std::pair<double,double>>> &Regions, std::vector<std::vector<double>> &RegionBounds,
+    std::vector<double> &dVp, std::vector<double> &dVs, std::vector<double> &dRho);
+void SaveModelCache(
+    const std::string &file, const std::uint64_t &key,
+    const std::vector<double> &R, const std::vector<double> &Vp, const std::vector<double> &Vs, const std::vector<double> &Rho,
+    const std::vector<std::vector<std::pair<double,double>>> &Regions, const std::vector<std::vector<double>> &RegionBounds,
+    const std::vector<double> &dVp, const std::vector<double> &dVs, const std::vector<double> &dRho);
+void RectifyPolygon(const std::vector<double> &polygonTheta, const std::vector<double> &polygonDepth,
+                    const std::vector<double> &R, const double &RectifyLimit,
+                    std::vector<std::pair<double,double>> &Region, std::vector<double> &Bounds);
+void PreprocessModel(
+    const std::vector<double> &initRayDepth,
+    const std::vector<double> &gridDepth1,const std::vector<double> &gridDepth2,const std::vector<double> &gridInc,
+    const std::vector<double> &specialDepths,const std::vector<std::vector<double>> &Deviation,
+    const std::vector<std::vector<double>> &regionProperties,
+    const std::vector<std::vector<double>> &regionPolygonsTheta,
+    const std::vector<std::vector<double>> &regionPolygonsDepth,
+    const double &RectifyLimit, const double &AdaptiveGridMargin, const double &AdaptiveGridInc, const std::size_t &nThread,
+    std::vector<double> &R, std::vector<double> &Vp, std::vector<double> &Vs, std::vector<double> &Rho,
+    std::vector<std::vector<std::pair<double,double>>> &Regions, std::vector<std::vector<double>> &RegionBounds,
+    std::vector<double> &dVp, std::vector<double> &dVs, std::vector<double> &dRho);
+std::size_t PotentialSize(const std::vector<int> &initRaySteps, const int &branches);
 void followThisRay(
-    size_t i, size_t mySlot, std::atomic<size_t> &finalSize,
-    char **ReachSurfaces, int *ReachSurfacesSize, char **RayInfo, int *RayInfoSize,
-    double **RaysTheta, int *RaysN, double **RaysRadius,
+    size_t i, std::atomic<size_t> &finalSize, TraceResult &Out,
     std::vector<Ray> &RayHeads, int branches, const std::vector<double> &specialDepths,
-    const std::vector<std::vector<double>> &R, const std::vector<std::vector<double>> &Vp,
-    const std::vector<std::vector<double>> &Vs,const std::vector<std::vector<double>> &Rho,
+    const std::vector<double> &R, const std::vector<double> &Vp, const std::vector<double> &Vs,const std::vector<double> &Rho,
     const std::vector<std::vector<std::pair<double,double>>> &Regions, const std::vector<std::vector<double>> &RegionBounds,
     const std::vector<double> &dVp, const std::vector<double> &dVs,const std::vector<double> &dRho,
-    const bool &DebugInfo,const bool &TS,const bool &TD,const bool &RS,const bool &RD, const bool &StopAtSurface);
+    const bool &DebugInfo,const bool &TS,const bool &TD,const bool &RS,const bool &RD, const bool &StopAtSurface,
+    LegCache *Cache, MergeMap *Merger, const double &MergeTolerance, const std::size_t &Dispatched,
+    const LegCache::Leg *Precomputed, const int &LayerIntegrator, const std::set<std::string> *Survivors,
+    const std::size_t &RayNumberOffset, const std::vector<SmoothAnomaly> *Anomalies, const int &OutputPrecision);
+void CollectArrivals(const TraceResult &Out, const double &sourceTheta,
+                     std::map<std::string,std::vector<std::vector<double>>> &Lineages);
+std::vector<std::vector<std::vector<double>>> MonotoneBranches(const std::vector<std::vector<double>> &Arrivals,
+                                                               const double &MaxGap);
+bool InterpolateBranch(const std::vector<std::vector<double>> &Branch, const double &dist, std::vector<double> &Values);
+std::vector<GatherArrival> ReceiverGather(const TraceBatch &Batch, const TraceResult &Out, const std::vector<double> &Stations);
+void SaveTravelTimeTable(const std::string &file, const TravelTimeTable &Table);
+void SaveRayPaths(const std::string &file, const TraceResult &Out);
+bool LoadTravelTimeTable(const std::string &file, TravelTimeTable &Table);
+void CopyResults(const Tracer &tracer, const TraceResult &Out,
+    char **ReachSurfaces, int *ReachSurfacesSize, char **RayInfo, int *RayInfoSize,
+    int *RegionN,double **RegionsTheta,double **RegionsRadius,
+    double **RaysTheta, int *RaysN, double **RaysRadius);
 void PreprocessAndRun(
     const std::vector<int> &initRaySteps,const std::vector<int> &initRayComp,const std::vector<int> &initRayColor,
     const std::vector<double> &initRayTheta,const std::vector<double> &initRayDepth,const std::vector<double> &initRayTakeoff,
@@ -65,6 +452,12 @@ void PreprocessAndRun(
     const std::vector<std::vector<double>> &regionPolygonsDepth,
     const double &RectifyLimit, const bool &TS, const bool &TD, const bool &RS, const bool &RD,
     const std::size_t &nThread, const bool &DebugInfo, const bool &StopAtSurface,
+    const bool &UseLegCache, const double &LegCacheRaypInc,
+    const bool &MergeRays, const double &MergeTolerance,
+    const bool &Wavefront, const std::size_t &BeamWidth, std::vector<std::pair<double,double>> &BeamDiscarded,
+    const std::size_t &RayBundle, const int &LayerIntegrator,
+    const double &AdaptiveGridMargin, const double &AdaptiveGridInc, const std::size_t &TwoPass,
+    const std::string &ModelCachePrefix,
     const std::size_t &branches, const std::size_t &potentialSize,
     char **ReachSurfaces, int *ReachSurfacesSize, char **RayInfo, int *RayInfoSize,
     int *RegionN,double **RegionsTheta,double **RegionsRadius,
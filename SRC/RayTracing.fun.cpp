@@ -1,7 +1,15 @@
+#include<array>
+#include<functional>
 #include<mutex>
 #include<thread>
 #include<condition_variable>
 #include<queue>
+#include<numeric>
+#include<cstdint>
+#include<cstdio>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
 
 #include<Ray.hpp>
 
@@ -9,20 +17,48 @@
 #include<LineJunction.hpp>
 #include<LocDist.hpp>
 #include<PointInPolygon.hpp>
-#include<PREM.hpp>
 #include<RayPath.hpp>
 #include<SegmentJunction.hpp>
 #include<PlaneWaveCoefficients.hpp>
 
 using namespace std;
 
-mutex mtx;
-condition_variable cv;
-queue<size_t> emptySlot;
+// Tabulated PREM (isotropic, no ocean). Gives the same values as "Dvp", "Dvs" and "Drho" from PREM.hpp,
+// but all three properties come from one shell lookup.
+// Shell k covers PREMShellTop[k-1] <= r < PREMShellTop[k] (the last shell includes the surface).
+// Coefficients are {c3,c2,c1,c0} of c3*x*x*x+c2*x*x+c1*x+c0, x=r/6371, for {vp,vs,rho}.
+constexpr size_t PREMShellN=12;
+constexpr double PREMShellTop[PREMShellN]={1221.5,3480.0,3630.0,5600.0,5701.0,5771.0,5971.0,6151.0,6291.0,6346.6,6356.0,6371.0+1e-5};
+constexpr double PREMCoef[PREMShellN][3][4]={
+    {{0,-6.3640,0,11.2622},             {0,-4.4475,0,3.6678},              {0,-8.8381,0,13.0885}},           // inner core
+    {{-13.5732,4.8023,-4.0362,11.0487}, {0,0,0,0},                         {-5.5281,-3.6426,-1.2638,12.5815}}, // outer core
+    {{-2.5514,5.5242,-5.3181,15.3891},  {0.9783,-2.0834,1.4672,6.9254},    {-3.0807,5.5283,-6.4761,7.9565}},  // D''
+    {{-26.6419,51.4832,-40.4673,24.9520},{-9.2777,17.4575,-13.7818,11.1671},{-3.0807,5.5283,-6.4761,7.9565}},  // 771 ~ 2741 km
+    {{-2.5514,5.5242,-23.6027,29.2766}, {0.9783,-2.0834,-17.2473,22.3459}, {-3.0807,5.5283,-6.4761,7.9565}},  // 670 ~ 771 km
+    {{0,0,-9.8672,19.0957},             {0,0,-4.9324,9.9839},              {0,0,-1.4836,5.3197}},            // 600 ~ 670 km
+    {{0,0,-32.6166,39.7027},            {0,0,-18.5856,22.3512},            {0,0,-8.0298,11.2494}},           // 400 ~ 600 km
+    {{0,0,-12.2569,20.3926},            {0,0,-4.4597,8.9496},              {0,0,-3.8045,7.1089}},            // 220 ~ 400 km
+    {{0,0,3.9382,4.1875},               {0,0,2.3481,2.1519},               {0,0,0.6924,2.6910}},             // LVZ (iso)
+    {{0,0,3.9382,4.1875},               {0,0,2.3481,2.1519},               {0,0,0.6924,2.6910}},             // LID (iso)
+    {{0,0,0,6.800},                     {0,0,0,3.900},                     {0,0,0,2.900}},                   // crust 1
+    {{0,0,0,5.800},                     {0,0,0,3.200},                     {0,0,0,2.600}}                    // crust 2
+};
+
+void PREMTabulated(const double &depth, double &vp, double &vs, double &rho){
+    double r=6371.0-depth,x=r/6371.0;
+    size_t k=upper_bound(PREMShellTop,PREMShellTop+PREMShellN-1,r)-PREMShellTop;
+    if (r<0 || r>PREMShellTop[PREMShellN-1]) {vp=vs=rho=0;return;}
+    double *out[3]={&vp,&vs,&rho};
+    for (size_t j=0;j<3;++j) {
+        const double *c=PREMCoef[k][j];
+        *out[j]=c[0]*x*x*x+c[1]*x*x+c[2]*x+c[3];
+    }
+}
 
 // Utilities for 1D-altering the PREM model.
 vector<double> MakeRef(const double &depth,const vector<vector<double>> &dev){
-    double rho=Drho(depth),vs=Dvs(depth),vp=Dvp(depth);
+    double rho,vs,vp;
+    PREMTabulated(depth,vp,vs,rho);
     for (const auto &item: dev) {
         if (item[0]<depth && depth<=item[1]) {
 
@@ -35,6 +71,45 @@ vector<double> MakeRef(const double &depth,const vector<vector<double>> &dev){
     return {vp,vs,rho};
 }
 
+// "MakeRef" for all radii in R, computed by nThread threads.
+// If the deviation intervals don't overlap, they are searched by binary search.
+void MakeRefLayers(const vector<double> &R, const vector<vector<double>> &dev,
+                   vector<double> &Vp, vector<double> &Vs, vector<double> &Rho, const size_t &nThread){
+
+    vector<vector<double>> sortedDev(dev);
+    sort(sortedDev.begin(),sortedDev.end());
+    bool overlap=false;
+    for (size_t i=1;i<sortedDev.size();++i) overlap|=(sortedDev[i][0]<sortedDev[i-1][1]);
+
+    Vp.resize(R.size());Vs.resize(R.size());Rho.resize(R.size());
+
+    auto work=[&](size_t begin, size_t end){
+        for (size_t i=begin;i<end;++i) {
+            double depth=_RE-R[i];
+            if (overlap) {
+                auto ans=MakeRef(depth,dev);
+                Vp[i]=ans[0];Vs[i]=ans[1];Rho[i]=ans[2];
+                continue;
+            }
+            PREMTabulated(depth,Vp[i],Vs[i],Rho[i]);
+            auto it=lower_bound(sortedDev.begin(),sortedDev.end(),depth,[](const vector<double> &a, const double &d){
+                return a[0]<d;
+            });
+            if (it!=sortedDev.begin() && depth<=(*prev(it))[1]) {
+                const auto &item=*prev(it);
+                Vp[i]*=(1+item[2]/100);
+                Vs[i]*=(1+item[3]/100);
+                Rho[i]*=(1+item[4]/100);
+            }
+        }
+    };
+
+    size_t N=max((size_t)1,min(nThread,R.size()/10000+1)),chunk=(R.size()+N-1)/N;
+    vector<thread> allThreads;
+    for (size_t t=0;t<N;++t) allThreads.push_back(thread(work,min(R.size(),t*chunk),min(R.size(),(t+1)*chunk)));
+    for (auto &t: allThreads) t.join();
+}
+
 // Utilities for finding the index in an array that is cloeset to a given radius.
 // array is sorted descending.
 size_t findClosetLayer(const vector<double> &R, const double &r){
@@ -60,54 +135,581 @@ size_t findClosetDepth(const vector<double> &D, const double &d){
     }
 }
 
-// generating rays born from RayHeads[i]
-void followThisRay(
-    size_t i, size_t mySlot, atomic<size_t> &finalSize,
-    char **ReachSurfaces, int *ReachSurfacesSize, char **RayInfo, int *RayInfoSize,
-    double **RaysTheta, int *RaysN, double **RaysRadius,
-    vector<Ray> &RayHeads, int branches, const vector<double> &specialDepths,
-    const vector<vector<double>> &R, const vector<vector<double>> &Vp,
-    const vector<vector<double>> &Vs,const vector<vector<double>> &Rho,
-    const vector<vector<pair<double,double>>> &Regions, const vector<vector<double>> &RegionBounds,
-    const vector<double> &dVp, const vector<double> &dVs,const vector<double> &dRho,
-    const bool &DebugInfo,const bool &TS,const bool &TD,const bool &RS,const bool &RD, const bool &StopAtSurface){
-
-    if (RayHeads[i].RemainingLegs==0 || i>=finalSize.load()) {
-
-        unique_lock<mutex> lck(mtx);
-        emptySlot.push(mySlot);
-        cv.notify_one();
-
-        return;
-    }
-
+// Utilities for finding the layers of a leg from "MinDepth" to "MaxDepth" km. (binary search, "r" is sorted descending)
+// [first,last] is the smallest range of "r" in which the start and end layer search of "RayPath" gives the same layers
+// as in the whole "r": from the layer just above "MinDepth", to the last repeat of the first layer below "MaxDepth".
+void findLegLayers(const vector<double> &r, const double &MinDepth, const double &MaxDepth, size_t &first, size_t &last){
+    first=lower_bound(r.begin(),r.end(),_RE-MinDepth,greater<double>())-r.begin();
+    if (first>0) --first;
+    last=upper_bound(r.begin(),r.end(),_RE-MaxDepth,greater<double>())-r.begin();
+    if (last<r.size()) last=upper_bound(r.begin()+last,r.end(),r[last],greater<double>())-r.begin();
+    last=max(first,last-1);
+}
 
-    // Locate the begining and ending depths for the next leg.
+// Locate the begining and ending depths of the next leg of a ray.
+void findLegDepths(const Ray &ray, const vector<double> &specialDepths, const vector<vector<double>> &RegionBounds,
+                   double &Top, double &Bot){
 
     /// ... among special depths.
 
     //// Which special depth is cloest to ray head depth?
-    double RayHeadDepth=_RE-RayHeads[i].Pr;
+    double RayHeadDepth=_RE-ray.Pr;
     size_t Cloest=findClosetDepth(specialDepths,RayHeadDepth);
 
     //// Next depth should be the cloest special depth at the correct side (ray is going up/down).
     //// Is the ray going up or down? Is the ray already at the cloest special depth? If yes, adjust the next depth.
     double NextDepth=specialDepths[Cloest];
-    if (RayHeads[i].GoUp && (specialDepths[Cloest]>RayHeadDepth || RayHeadDepth==specialDepths[Cloest]))
+    if (ray.GoUp && (specialDepths[Cloest]>RayHeadDepth || RayHeadDepth==specialDepths[Cloest]))
         NextDepth=specialDepths[Cloest-1];
-    else if (!RayHeads[i].GoUp && (specialDepths[Cloest]<RayHeadDepth || specialDepths[Cloest]==RayHeadDepth))
+    else if (!ray.GoUp && (specialDepths[Cloest]<RayHeadDepth || specialDepths[Cloest]==RayHeadDepth))
         NextDepth=specialDepths[Cloest+1];
 
-    double Top=min(RayHeadDepth,NextDepth),Bot=max(RayHeadDepth,NextDepth);
+    Top=min(RayHeadDepth,NextDepth);
+    Bot=max(RayHeadDepth,NextDepth);
 
     /// ... among current 2D "Regions" vertical limits.
+    Top=max(Top,_RE-RegionBounds[ray.InRegion][3]);
+    Bot=min(Bot,_RE-RegionBounds[ray.InRegion][2]);
+}
+
+// Multi-ray version of "RayPath": trace "n" (<=_RAYBUNDLE) rays with different ray parameters through the same
+// layers (same r, v, MinDepth and MaxDepth) in lockstep. Results are identical to calling "RayPath" on each ray.
+// Per-layer terms are computed for all lanes at once (written to be vectorized by the compiler);
+// rays that turned are masked out and finished lanes are skipped.
+void RayPathBundle(const vector<double> &r, const vector<double> &v, const double *rayp, const size_t &n,
+                   const double &MinDepth, const double &MaxDepth, LegCache::Leg *legs, const double &TurningAngle){
+
+    // check inputs.
+    double RE=6371.0;
+    for (size_t l=0;l<n;++l) {
+        legs[l].Degree.clear();
+        legs[l].Ans={{-1,-1},false};
+    }
+    if (n==0 || MaxDepth<=MinDepth || MaxDepth>RE-r.back() || MinDepth<RE-r[0]) return;
+    if (!is_sorted(r.begin(),r.end(),[](const double &a, const double &b){return a>=b;})) return;
+
+    // locate our start Layer and end Layer. (same as "RayPath")
+    size_t P1;
+    double CurMin=numeric_limits<double>::max();
+    for (P1=0;P1<r.size();++P1) {
+        double NewMin=fabs(RE-MinDepth-r[P1]);
+        if (CurMin<NewMin) {--P1;break;}
+        CurMin=NewMin;
+    }
+
+    size_t P2;
+    CurMin=numeric_limits<double>::max();
+    for (P2=0;P2<r.size();++P2) {
+        double NewMin=fabs(RE-MaxDepth-r[P2]);
+        if (CurMin<NewMin) {--P2;break;}
+        CurMin=NewMin;
+    }
+    if (P2==r.size()) --P2;
+
+    // start ray tracing. (B,C,D are the same as in "RayPath")
+    double MaxAngle=sin(TurningAngle*M_PI/180);
+    double Rayp[_RAYBUNDLE],Deg[_RAYBUNDLE],B[_RAYBUNDLE],C[_RAYBUNDLE],D[_RAYBUNDLE];
+    bool Active[_RAYBUNDLE];
+    size_t activeN=n;
+    for (size_t l=0;l<_RAYBUNDLE;++l) {
+        Rayp[l]=(l<n?rayp[l]*180/M_PI:0);
+        Deg[l]=0;
+        Active[l]=(l<n);
+    }
+    for (size_t l=0;l<n;++l) {
+        legs[l].Ans={{0,0},false};
+        legs[l].Degree.reserve(P2-P1+1);
+    }
+
+    for (size_t i=P1;i<P2 && activeN>0;++i){
+
+        const double r0=r[i],r1=r[i+1],v1=v[i+1];
+
+        // All lanes at once.
+        for (size_t l=0;l<_RAYBUNDLE;++l) {
+            B[l]=Rayp[l]*v1/r1;
+            C[l]=Rayp[l]*v1/r0;
+        }
+        for (size_t l=0;l<_RAYBUNDLE;++l)
+            D[l]=B[l]*sqrt(1-C[l]*C[l])-sqrt(1-B[l]*B[l])*C[l];
+
+        // Per lane: turning judgement, travel time and path.
+        for (size_t l=0;l<n;++l) {
+
+            if (!Active[l]) continue;
+            auto &leg=legs[l];
+
+            if (C[l]>=1 || B[l]>1) {
+                leg.LastRadiusIndex=i;
+                leg.Degree.push_back(Deg[l]);
+                leg.Ans.second=true;
+                Active[l]=false;
+                --activeN;
+                continue;
+            }
+
+            double dist=r1/C[l]*D[l];
+            if (std::isnan(dist)) dist=LocDist(0,0,r0,asin(D[l])*180/M_PI,0,r1);
+
+            leg.Ans.first.first+=dist/v1;
+            leg.Ans.first.second+=dist;
+
+            leg.Degree.push_back(Deg[l]);
+            Deg[l]+=asin(D[l])*180/M_PI;
+
+            if (B[l]>=MaxAngle) {
+                leg.LastRadiusIndex=i+1;
+                leg.Degree.push_back(Deg[l]);
+                leg.Ans.second=true;
+                Active[l]=false;
+                --activeN;
+            }
+        }
+    }
+
+    for (size_t l=0;l<n;++l) {
+        if (!Active[l]) continue;
+        legs[l].LastRadiusIndex=P2;
+        legs[l].Degree.push_back(Deg[l]);
+    }
+}
+
+// Same interface and outputs as "RayPath", but each grid step is integrated analytically assuming the velocity
+// is linear in depth between two grid points in the Earth-flattened domain (z=-RE*ln(r/RE), vf=v*RE/r).
+// Within a step the ray is then a circular arc with closed-form horizontal distance and travel time,
+// so coarse grids give travel times close to those of very fine grids traced with "RayPath".
+// A ray turning inside a step gets the contribution down to its turning depth and back (assigned to the upper grid point).
+// Velocity jumps at grid points inside the leg (e.g. 410, 660) are treated as a steep gradient across one step.
+// Travel distance is measured by chords between grid points (same as "RayPath").
+pair<pair<double,double>,bool> RayPathGradient(const vector<double> &r, const vector<double> &v,
+                                               const double &rayp, const double &MinDepth, const double &MaxDepth,
+                                               vector<double> &degree, size_t &radius, const double &TurningAngle){
+
+    // check inputs.
+    double RE=6371.0;
+    if (MaxDepth<=MinDepth || MaxDepth>RE-r.back() || MinDepth<RE-r[0]) return {{-1,-1},false};
+    if (!is_sorted(r.begin(),r.end(),[](const double &a, const double &b){return a>=b;})) return {{-1,-1},false};
+
+    // locate our start Layer and end Layer. (same as "RayPath")
+    size_t P1;
+    double CurMin=numeric_limits<double>::max();
+    for (P1=0;P1<r.size();++P1) {
+        double NewMin=fabs(RE-MinDepth-r[P1]);
+        if (CurMin<NewMin) {--P1;break;}
+        CurMin=NewMin;
+    }
+
+    size_t P2;
+    CurMin=numeric_limits<double>::max();
+    for (P2=0;P2<r.size();++P2) {
+        double NewMin=fabs(RE-MaxDepth-r[P2]);
+        if (CurMin<NewMin) {--P2;break;}
+        CurMin=NewMin;
+    }
+    if (P2==r.size()) --P2;
+
+    degree.clear();
+
+    // start ray tracing.
+    //
+    //   p  = flat ray parameter (sec/km), s=p*vf=sin(incident angle), c=cos(incident angle), g=dvf/dz.
+    //   dx = p*(vf1+vf2)*dz/(c1+c2)               (equals (c1-c2)/(p*g), but stable for small p and small g)
+    //   dt = 1/g*ln( (vf2/vf1)*(1+c1)/(1+c2) )    (or dz/(vf*c) when g is negligible)
+
+    double deg=0,MaxAngle=sin(TurningAngle*M_PI/180),p=rayp*180/M_PI/RE;
+    pair<pair<double,double>,bool> ans{{0,0},false};
+
+    for (size_t i=P1;i<P2;++i){
+
+        // The leg could start at a discontinuity, where v[P1] belongs to the layer above. Use v[P1+1] for the first step.
+        double z1=-RE*log(r[i]/RE),z2=-RE*log(r[i+1]/RE),dz=z2-z1;
+        double vf1=(i==P1?v[i+1]:v[i])*RE/r[i],vf2=v[i+1]*RE/r[i+1],g=(vf2-vf1)/dz;
+        double s1=p*vf1,s2=p*vf2,c1=sqrt(max(0.0,1-s1*s1));
+
+        // Judge turning.
+        if (s1>=1 || s2>=1) {
+
+            // The ray reaches its turning depth (vf=1/p) inside this step. Go down there and come back up.
+            if (s1<1 && g>0) {
+                double dx=c1/(p*g),dt=log((1+c1)/s1)/g;
+                double rt=RE*exp(-(z1+(1/p-vf1)/g)/RE),ddeg=dx/RE*180/M_PI;
+                ans.first.first+=2*dt;
+                ans.first.second+=2*LocDist(0,0,r[i],ddeg,0,rt);
+                deg+=2*ddeg;
+            }
+            radius=i;
+            degree.push_back(deg);
+            ans.second=true;
+            return ans;
+        }
+
+        double c2=sqrt(1-s2*s2);
+        double dx=p*(vf1+vf2)*dz/(c1+c2),dt;
+        if (fabs(vf2-vf1)<1e-9*vf1) dt=dz*4/(vf1+vf2)/(c1+c2);
+        else dt=log((vf2/vf1)*(1+c1)/(1+c2))/g;
+        double ddeg=dx/RE*180/M_PI;
+
+        // store travel time and distance of this step.
+        ans.first.first+=dt;
+        ans.first.second+=LocDist(0,0,r[i],ddeg,0,r[i+1]);
+
+        // store the path of this step.
+        degree.push_back(deg);
+        deg+=ddeg;
+
+        // Judge turning.
+        if (s2>=MaxAngle) {
+            radius=i+1;
+            degree.push_back(deg);
+            ans.second=true;
+            return ans;
+        }
+    }
+
+    radius=P2;
+    degree.push_back(deg);
+    return ans;
+}
+
+// Velocity (or density) scale of the smooth anomalies at ("theta" deg, "r" km). "Property": 0/1/2 for P/S/density.
+// If "dTheta" and "dR" are given, the derivatives of the scale (per deg, per km) are returned in them.
+double AnomalyScale(const vector<SmoothAnomaly> &Anomalies, const int &Property, const double &theta, const double &r,
+                    double *dTheta, double *dR){
+
+    double ans=1,dt=0,dr=0;
+    for (const auto &item:Anomalies) {
+        double d=(Property==0?item.dVp:(Property==1?item.dVs:item.dRho))/100;
+        double x=Lon2180(theta-item.Theta)/item.ThetaWidth,y=(_RE-r-item.Depth)/item.DepthWidth;
+        if (d==0 || fabs(x)>8 || fabs(y)>8) continue;
+        double g=d*exp(-(x*x+y*y)/2);
+        ans+=g;
+        dt-=g*x/item.ThetaWidth;
+        dr+=g*y/item.DepthWidth;
+    }
+    if (dTheta!=nullptr) *dTheta=dt;
+    if (dR!=nullptr) *dR=dr;
+    return ans;
+}
+
+// Trace one leg through a smooth 2D velocity field: scale*v(r)*AnomalyScale(theta,r), v linear between the layers "r".
+// With "psi" the ray direction from the upward radial direction (positive towards increasing theta), the ray equations
+//
+//   dr/ds=cos(psi), dtheta/ds=sin(psi)/r, dpsi/ds=-sin(psi)/r+(dv/dr*sin(psi)-dv/dtheta*cos(psi)/r)/v, dt/ds=1/v
+//
+// are integrated over the arc length "s" by Runge-Kutta (Dormand-Prince 5(4)) with step-size control, so steps are long
+// where the field is smooth. Velocity jumps are crossed with Snell's law; a down-going ray totally reflected at a jump turns
+// there. The leg starts at ("Pt","Pr") with "rayp" (sec/deg), and ends at "MinDepth" (going up), "MaxDepth" (going down), or
+// after turning, back at the deepest layer it crossed (like "RayPath").
+// If the leg can't be traced (too many steps, no velocity, an up-going leg turning back down or reflected at a jump),
+// "degree" is returned empty and "rayp" is unchanged: the caller keeps the 1D result.
+// The path is sampled at the layers. "degree", "radius" and the returned {{travel time, travel distance}, turned} are the same
+// as "RayPath" (for up-going legs, before the reversal in "followThisRay"); travel distance is measured by chords.
+// "Velocity" is the velocity at each sample, in travel order. "rayp" becomes the ray parameter at the end of the leg.
+pair<pair<double,double>,bool> RayPathSmooth(const vector<double> &r, const vector<double> &v, const double &scale,
+                                             const vector<SmoothAnomaly> &Anomalies, const int &Property,
+                                             const double &Pt, const double &Pr, const bool &GoUp, const bool &GoLeft,
+                                             double &rayp, const double &MinDepth, const double &MaxDepth,
+                                             vector<double> &degree, size_t &radius, vector<double> &Velocity){
+
+    // locate our start Layer and end Layer. (same as "RayPath")
+    size_t P1;
+    double CurMin=numeric_limits<double>::max();
+    for (P1=0;P1<r.size();++P1) {
+        double NewMin=fabs(_RE-MinDepth-r[P1]);
+        if (CurMin<NewMin) {--P1;break;}
+        CurMin=NewMin;
+    }
+
+    size_t P2;
+    CurMin=numeric_limits<double>::max();
+    for (P2=0;P2<r.size();++P2) {
+        double NewMin=fabs(_RE-MaxDepth-r[P2]);
+        if (CurMin<NewMin) {--P2;break;}
+        CurMin=NewMin;
+    }
+    if (P2==r.size()) --P2;
+
+    degree.assign(1,0);
+    Velocity.clear();
+    radius=(GoUp?P2:P1);
+    pair<pair<double,double>,bool> ans{{0,0},false};
+    if (P2<=P1) return ans;
+
+    // Velocity jumps: layers r[k-1] ~ r[k] changing by more than 1% per km (repeated radii, or property jumps spread over
+    // one grid step). Thin steps could fall between Runge-Kutta stages, so the jump is put at r[k] (the velocity above is
+    // v[k-1]) and crossed with Snell's law.
+    vector<bool> Sharp(r.size(),false);
+    for (size_t k=P1+1;k<=P2;++k)
+        Sharp[k]=(fabs(v[k-1]-v[k])>0.01*max(fabs(v[k-1]),fabs(v[k]))*(r[k-1]-r[k]));
+
+    // Velocity, and its derivatives (per km, per radian) at ("x" km, "theta" radian).
+    // At a velocity jump, "x" on the jump radius belongs to the layer above. Trial steps beyond the ends of the leg see
+    // the velocity at the ends.
+    double Eps=1e-9,rEnd=_RE-(GoUp?MinDepth:MaxDepth),rLow=min(Pr,rEnd),rHigh=max(Pr,rEnd)-Eps;
+    auto field=[&](double x, const double &theta, double &vr, double &vt){
+        x=min(rHigh,max(rLow,x));
+        size_t k=lower_bound(r.begin(),r.end(),x,greater<double>())-r.begin();
+        k=min(max(k,(size_t)1),r.size()-1);
+        double g=(Sharp[k] || r[k-1]==r[k]?0:(v[k-1]-v[k])/(r[k-1]-r[k])),v0=scale*(Sharp[k]?v[k-1]:v[k]+g*(x-r[k]));
+        double at,ar,a=AnomalyScale(Anomalies,Property,theta*180/M_PI,x,&at,&ar);
+        vr=scale*g*a+v0*ar;
+        vt=v0*at*180/M_PI;
+        return v0*a;
+    };
+
+    // Failure: the caller falls back to the 1D reference result.
+    auto fail=[&](){
+        degree.clear();
+        Velocity.clear();
+        return ans;
+    };
+
+    // State: {r, theta, psi, t}.
+    bool bad=false;
+    auto rhs=[&](const array<double,4> &y, array<double,4> &f){
+        double vr,vt,c=cos(y[2]),s=sin(y[2]),vel=field(y[0],y[1],vr,vt);
+        if (vel<=0) {bad=true;vel=1;}
+        f={c,s/y[0],-s/y[0]+(vr*s-vt*c/y[0])/vel,1/vel};
+    };
+
+    // One Dormand-Prince step of length "h" from "y0" (derivatives "k1"). "k7" are the derivatives at "y1".
+    auto step=[&](const array<double,4> &y0, const array<double,4> &k1, const double &h,
+                  array<double,4> &y1, array<double,4> &k7, array<double,4> &err){
+        array<double,4> k2,k3,k4,k5,k6,z;
+        for (size_t n=0;n<4;++n) z[n]=y0[n]+h*k1[n]/5;
+        rhs(z,k2);
+        for (size_t n=0;n<4;++n) z[n]=y0[n]+h*(3*k1[n]+9*k2[n])/40;
+        rhs(z,k3);
+        for (size_t n=0;n<4;++n) z[n]=y0[n]+h*(44.0/45*k1[n]-56.0/15*k2[n]+32.0/9*k3[n]);
+        rhs(z,k4);
+        for (size_t n=0;n<4;++n) z[n]=y0[n]+h*(19372.0/6561*k1[n]-25360.0/2187*k2[n]+64448.0/6561*k3[n]-212.0/729*k4[n]);
+        rhs(z,k5);
+        for (size_t n=0;n<4;++n) z[n]=y0[n]+h*(9017.0/3168*k1[n]-355.0/33*k2[n]+46732.0/5247*k3[n]+49.0/176*k4[n]-5103.0/18656*k5[n]);
+        rhs(z,k6);
+        for (size_t n=0;n<4;++n) y1[n]=y0[n]+h*(35.0/384*k1[n]+500.0/1113*k3[n]+125.0/192*k4[n]-2187.0/6784*k5[n]+11.0/84*k6[n]);
+        rhs(y1,k7);
+        for (size_t n=0;n<4;++n) err[n]=h*(71.0/57600*k1[n]-71.0/16695*k3[n]+71.0/1920*k4[n]-17253.0/339200*k5[n]
+                                          +22.0/525*k6[n]-1.0/40*k7[n]);
+    };
+
+    // Start. (nudged off a velocity jump, to the side the ray goes)
+    double vr,vt,rBack=0,sinI=min(1.0,rayp*180/M_PI*field(Pr+(GoUp?Eps:-Eps),Pt*M_PI/180,vr,vt)/Pr);
+    array<double,4> y={Pr+(GoUp?Eps:-Eps),Pt*M_PI/180,(GoUp?asin(sinI):M_PI-asin(sinI))*(GoLeft?-1:1),0},f,y1,f1,err;
+    rhs(y,f);
+
+    // Velocity jumps inside the leg, in travel order.
+    vector<size_t> Jumps;
+    for (size_t k=P1+1;k<=P2;++k)
+        if (Sharp[k] && r[k]<max(Pr,rEnd) && r[k]>min(Pr,rEnd)) Jumps.push_back(k);
+    if (GoUp) reverse(Jumps.begin(),Jumps.end());
+    size_t nextJump=0;
+
+    // Integrate until the leg ends. Accepted points are kept for the sampling.
+    // Stage 0: going down; 1: going back up after turning; 2: going up.
+    const double Tol=1e-6,MaxStep=100;
+    vector<array<double,4>> Y{y},F{f};
+    vector<double> H;
+    int Stage=(GoUp?2:0);
+    double h=10;
+
+    for (size_t Count=0;;++Count) {
+
+        if (Count>100000) return fail();
+        step(y,f,h,y1,f1,err);
+        if (bad) return fail();
+
+        // Error control: position (km), direction (as a position error over 1000 km) and time (as a distance at 10 km/sec).
+        double e=max({fabs(err[0]),y[0]*fabs(err[1]),1000*fabs(err[2]),10*fabs(err[3])})/Tol;
+        if (e>1) {
+            h*=max(0.1,0.9*pow(e,-0.2));
+            continue;
+        }
+
+        // Events in this step: the end of the leg, turning and velocity jumps. ("g" turns <=0 at the event)
+        vector<function<double(const array<double,4> &)>> Events;
+        if (Stage==0) {
+            Events.push_back([&](const array<double,4> &z){return z[0]-rEnd;});
+            Events.push_back([&](const array<double,4> &z){return -cos(z[2]);});
+        }
+        else if (Stage==1) Events.push_back([&](const array<double,4> &z){return rBack-z[0];});
+        else {
+            Events.push_back([&](const array<double,4> &z){return rEnd-z[0];});
+            Events.push_back([&](const array<double,4> &z){return cos(z[2]);});
+        }
+        if (Stage!=1 && nextJump<Jumps.size())
+            Events.push_back([&](const array<double,4> &z){return (GoUp?r[Jumps[nextJump]]-z[0]:z[0]-r[Jumps[nextJump]]);});
+
+        // Locate the first event by bisection on the step length.
+        int Event=-1;
+        double hEvent=h;
+        for (size_t k=0;k<Events.size();++k) {
+            if (Events[k](y1)>0) continue;
+            double lo=0,hi=h;
+            array<double,4> z,fz,ez;
+            for (int iter=0;iter<60;++iter) {
+                double mid=(lo+hi)/2;
+                step(y,f,mid,z,fz,ez);
+                (Events[k](z)>0?lo:hi)=mid;
+            }
+            if (hi<hEvent || Event==-1) {Event=(int)k;hEvent=hi;}
+        }
+        if (Event!=-1 && hEvent<h) {
+            h=hEvent;
+            step(y,f,h,y1,f1,err);
+        }
+
+        // Accept.
+        y=y1;f=f1;
+        Y.push_back(y);F.push_back(f);H.push_back(h);
+        h=min(MaxStep,h*min(5.0,0.9*pow(max(e,1e-10),-0.2)));
+
+        if (Event==0) {
+            Y.back()[0]=(Stage==1?rBack:rEnd);
+            break;
+        }
+        else if (Event==1 && Stage==2) return fail();
+        else if (Event==1 && Stage==0) {
+            // Turned. Come back up to the deepest layer crossed.
+            Stage=1;
+            size_t j=P1;
+            while (j+1<=P2 && r[j+1]>y[0]) ++j;
+            rBack=r[j];
+            radius=j;
+            ans.second=true;
+            if (j==P1) return ans;
+        }
+        else if (Event!=-1) {
+            // Velocity jump: Snell's law at this radius, then continue on the other side.
+            size_t k=Jumps[nextJump];
+            double c1=v[k-1],c2=v[k];
+            if (GoUp) swap(c1,c2);
+            if (c1<=0 || c2<=0 || (GoUp && fabs(sin(y[2])*c2/c1)>=1)) return fail();
+            if (fabs(sin(y[2])*c2/c1)>=1) {
+                // Totally reflected going down: a turn at the jump (as "RayPath"), back up to the layer above it.
+                y[0]=r[k]+Eps;
+                y[2]=(y[2]>0?M_PI:-M_PI)-y[2];
+                rhs(y,f);
+                Y.push_back(y);F.push_back(f);H.push_back(0);
+                Stage=1;
+                size_t j=P1;
+                while (j+1<=P2 && r[j+1]>r[k]) ++j;
+                rBack=r[j];
+                radius=j;
+                ans.second=true;
+                if (j==P1) return ans;
+                continue;
+            }
+            double s=sin(y[2])*c2/c1;
+            y[0]=r[k]+(GoUp?Eps:-Eps);
+            y[2]=(GoUp?asin(s):(y[2]>0?M_PI:-M_PI)-asin(s));
+            rhs(y,f);
+            Y.push_back(y);F.push_back(f);H.push_back(0);
+            ++nextJump;
+        }
+    }
+    if (Stage==0) radius=P2;
+
+    // Sample at the layers: start, layers crossed, end.
+    vector<size_t> Layers;
+    if (GoUp) for (size_t j=P2+1;j-->P1;) Layers.push_back(j);
+    else for (size_t j=P1;j<=radius;++j) Layers.push_back(j);
+
+    vector<double> Theta{Y[0][1]};
+    size_t m=0;
+    for (size_t l=1;l+1<Layers.size();++l) {
+        double x=r[Layers[l]];
+        while (m+1<Y.size() && fabs(Y[m][0]-x)>2*Eps && !((Y[m][0]-x)*(Y[m+1][0]-x)<=0 && H[m]>0)) ++m;
+        if (m+1==Y.size()) return fail();
+        if (fabs(Y[m][0]-x)<=2*Eps) {
+            Theta.push_back(Y[m][1]);
+            continue;
+        }
+
+        // Cubic Hermite interpolation within the step, bisection for the radius.
+        auto hermite=[&](const double &u, const size_t &n){
+            double u2=u*u,u3=u2*u;
+            return (2*u3-3*u2+1)*Y[m][n]+(u3-2*u2+u)*H[m]*F[m][n]+(-2*u3+3*u2)*Y[m+1][n]+(u3-u2)*H[m]*F[m+1][n];
+        };
+        double lo=0,hi=1;
+        bool down=(Y[m+1][0]<Y[m][0]);
+        for (int iter=0;iter<60;++iter) {
+            double mid=(lo+hi)/2;
+            ((hermite(mid,0)>x)==down?lo:hi)=mid;
+        }
+        Theta.push_back(hermite(hi,1));
+    }
+    Theta.push_back(Y.back()[1]);
+
+    degree.clear();
+    for (size_t l=0;l<Theta.size();++l) {
+        double x=r[Layers[l]],deg=(GoLeft?-1:1)*(Theta[l]-Theta[0])*180/M_PI;
+        degree.push_back(deg);
+        Velocity.push_back(scale*v[Layers[l]]*AnomalyScale(Anomalies,Property,Theta[l]*180/M_PI,x));
+        if (l>0) ans.first.second+=LocDist(0,0,r[Layers[l-1]],deg-degree[l-1],0,x);
+    }
+    ans.first.first=Y.back()[3];
+    rayp=M_PI/180*Y.back()[0]*fabs(sin(Y.back()[2]))/field(Y.back()[0]+(Stage==0?Eps:-Eps),Y.back()[1],vr,vt);
+
+    // Up-going legs are given as "RayPath" does: traced from the top.
+    if (GoUp) {
+        double totalDist=degree.back();
+        for (auto &item:degree) item=totalDist-item;
+        reverse(degree.begin(),degree.end());
+    }
+    return ans;
+}
+
+// Trace one leg with the chosen layer integrator. (0: "RayPath", straight chords; 1: "RayPathGradient";
+// 2: "RayPath", legs near smooth anomalies are traced again by "RayPathSmooth" in "followThisRay")
+// Velocities are v*scale: same path as rayp*scale in v, with travel time divided by scale.
+// Only the layers of the leg are handed to the integrator ("r" is shared by all regions, and "RayPath" scans its input
+// from the top); "radius" is still an index in "r".
+pair<pair<double,double>,bool> tracePath(const int &LayerIntegrator, const vector<double> &r, const vector<double> &v,
+                                         const double &scale, const double &rayp, const double &MinDepth, const double &MaxDepth,
+                                         vector<double> &degree, size_t &radius){
+    size_t first,last;
+    findLegLayers(r,MinDepth,MaxDepth,first,last);
+    vector<double> legR(r.begin()+first,r.begin()+last+1),legV(v.begin()+first,v.begin()+last+1);
+    auto ans=(LayerIntegrator==1?RayPathGradient(legR,legV,rayp*scale,MinDepth,MaxDepth,degree,radius,_TURNINGANGLE):
+                                  RayPath(legR,legV,rayp*scale,MinDepth,MaxDepth,degree,radius,_TURNINGANGLE));
+    if (ans.first.first>=0) radius+=first;
+    ans.first.first/=scale;
+    return ans;
+}
+
+// Upper limit of the number of rays (legs) generated by input rays of these many legs, each leg having "branches" children.
+size_t PotentialSize(const vector<int> &initRaySteps, const int &branches){
+    size_t ans=0;
+    for (size_t i=0;i<initRaySteps.size();++i){
+        if (branches<=1) ans+=initRaySteps[i];
+        else ans+=(1-pow(branches,initRaySteps[i]))/(1-branches);
+    }
+    return ans;
+}
+
+// generating rays born from RayHeads[i]
+void followThisRay(
+    size_t i, atomic<size_t> &finalSize, TraceResult &Out,
+    vector<Ray> &RayHeads, int branches, const vector<double> &specialDepths,
+    const vector<double> &R, const vector<double> &Vp, const vector<double> &Vs,const vector<double> &Rho,
+    const vector<vector<pair<double,double>>> &Regions, const vector<vector<double>> &RegionBounds,
+    const vector<double> &dVp, const vector<double> &dVs,const vector<double> &dRho,
+    const bool &DebugInfo,const bool &TS,const bool &TD,const bool &RS,const bool &RD, const bool &StopAtSurface,
+    LegCache *Cache, MergeMap *Merger, const double &MergeTolerance, const size_t &Dispatched,
+    const LegCache::Leg *Precomputed, const int &LayerIntegrator, const set<string> *Survivors, const size_t &RayNumberOffset,
+    const vector<SmoothAnomaly> *Anomalies, const int &OutputPrecision){
+
+    if (RayHeads[i].RemainingLegs==0 || i>=finalSize.load()) return;
+
+
+    // Locate the begining and ending depths for the next leg.
+    double Top,Bot;
+    findLegDepths(RayHeads[i],specialDepths,RegionBounds,Top,Bot);
     int CurRegion=RayHeads[i].InRegion;
-    Top=max(Top,_RE-RegionBounds[CurRegion][3]);
-    Bot=min(Bot,_RE-RegionBounds[CurRegion][2]);
 
     // Print some debug info.
     if (DebugInfo) {
-        RayHeads[i].Debug+=to_string(1+i)+" --> ";
+        RayHeads[i].Debug+=to_string(1+RayNumberOffset+i)+" --> ";
         cout << '\n' << "----------------------" ;
         cout << '\n' << "Calculating    : " << RayHeads[i].Debug;
         cout << "\nStart in region       : " << CurRegion;
@@ -115,26 +717,78 @@ void followThisRay(
         cout << "Will go as            : " << (RayHeads[i].IsP?"P, ":"S, ") << (RayHeads[i].GoUp?"Up, ":"Down, ")
             << (RayHeads[i].GoLeft?"Left":"Right") << endl;
         printf ("Ray tracing start, end: %.16lf --> %.16lf km with rayp: %.16lf sec/deg\n",Top,Bot,RayHeads[i].RayP);
-        printf ("Search region bounds  : %.16lf ~ %.16lf\n", _RE-R[CurRegion][0],_RE-R[CurRegion].back());
+        printf ("Search region bounds  : %.16lf ~ %.16lf\n", _RE-min(R[0],RegionBounds[CurRegion][3]),_RE-max(R.back(),RegionBounds[CurRegion][2]));
         printf ("\nStart ray tracing ...\n\n");
         cout << flush;
     }
 
 
-    // Use ray-tracing code "RayPath".
+    // Use ray-tracing code "RayPath" (or "RayPathGradient").
+    // In the 1D reference region, try the leg cache first.
     size_t lastRadiusIndex;
     vector<double> degree;
+    // Layers of all regions are the 1D reference layers (limited by "Top" and "Bot"), with velocities scaled by dv.
     const auto &v=(RayHeads[i].IsP?Vp:Vs);
-    auto ans=RayPath(R[CurRegion],v[CurRegion],RayHeads[i].RayP,Top,Bot,degree,lastRadiusIndex,_TURNINGANGLE);
+    const double dv=(RayHeads[i].IsP?dVp:dVs)[CurRegion];
+    pair<pair<double,double>,bool> ans;
+    // If the leg is already traced (by "RayPathBundle"), use it.
+    bool useCache=(Cache!=nullptr && CurRegion==0 && Precomputed==nullptr);
+    shared_ptr<const LegCache::Leg> cachedLeg=(useCache?Cache->find(RayHeads[i].IsP,RayHeads[i].RayP,Top,Bot):nullptr);
+
+    if (Precomputed!=nullptr) {
+        degree=Precomputed->Degree;
+        lastRadiusIndex=Precomputed->LastRadiusIndex;
+        ans=Precomputed->Ans;
+    }
+    else if (cachedLeg) {
+        degree=cachedLeg->Degree;
+        lastRadiusIndex=cachedLeg->LastRadiusIndex;
+        ans=cachedLeg->Ans;
+    }
+    else if (useCache) {
+        auto newLeg=make_shared<LegCache::Leg>();
+        newLeg->Ans=tracePath(LayerIntegrator,R,v,dv,Cache->keyRayp(RayHeads[i].RayP),Top,Bot,
+                              newLeg->Degree,newLeg->LastRadiusIndex);
+        Cache->insert(RayHeads[i].IsP,RayHeads[i].RayP,Top,Bot,newLeg);
+        degree=newLeg->Degree;
+        lastRadiusIndex=newLeg->LastRadiusIndex;
+        ans=newLeg->Ans;
+    }
+    else ans=tracePath(LayerIntegrator,R,v,dv,RayHeads[i].RayP,Top,Bot,degree,lastRadiusIndex);
+
+    // With smooth anomalies, 1D reference legs within 3 widths of an anomaly are traced again by "RayPathSmooth".
+    // "legV" is then the velocity along the leg, and the ray parameter changes along the leg.
+    vector<double> legV;
+    if (Anomalies!=nullptr && CurRegion==0 && !degree.empty()) {
+        double tMid=RayHeads[i].Pt+(RayHeads[i].GoLeft?-0.5:0.5)*degree.back(),rMid=_RE-(Top+Bot)/2;
+        bool nearAnomaly=false;
+        for (const auto &item:*Anomalies)
+            nearAnomaly|=(fabs(Lon2180(item.Theta-tMid))<=degree.back()/2+3*item.ThetaWidth &&
+                          fabs(_RE-item.Depth-rMid)<=(Bot-Top)/2+3*item.DepthWidth);
+        if (nearAnomaly) {
+            double rayp=RayHeads[i].RayP;
+            size_t smoothRadius;
+            vector<double> smoothDegree;
+            auto smooth=RayPathSmooth(R,v,dv,*Anomalies,(RayHeads[i].IsP?0:1),RayHeads[i].Pt,RayHeads[i].Pr,RayHeads[i].GoUp,
+                                      RayHeads[i].GoLeft,rayp,Top,Bot,smoothDegree,smoothRadius,legV);
+            // (if the smooth trace fails, the 1D result stands)
+            if (!smoothDegree.empty()) {
+                ans=smooth;
+                degree=move(smoothDegree);
+                lastRadiusIndex=smoothRadius;
+                RayHeads[i].RayP=rayp;
+            }
+        }
+    }
 
 
     // Fix the turnning flag. Because the velocity in Bot could be changed (different 1D model), the turnning judged by RayPath
     // may not be corrent under this case.
-    if (fabs(_RE-R[CurRegion][lastRadiusIndex]-Bot)<1e-6) ans.second=false;
+    if (fabs(_RE-R[lastRadiusIndex]-Bot)<1e-6) ans.second=false;
     else ans.second=true;
 
     if (DebugInfo) {
-        cout << "Ray turns? " << (ans.second?"Yes":"No") << ". Actual happened: " << _RE-R[CurRegion][lastRadiusIndex] << " / " << Bot << endl;
+        cout << "Ray turns? " << (ans.second?"Yes":"No") << ". Actual happened: " << _RE-R[lastRadiusIndex] << " / " << Bot << endl;
         cout << flush;
     }
 
@@ -146,11 +800,6 @@ void followThisRay(
     if (RayLength == 1) {
 
         RayHeads[i].RemainingLegs = 0;
-
-        unique_lock<mutex> lck(mtx);
-        emptySlot.push(mySlot);
-        cv.notify_one();
-
         return;
     }
 
@@ -160,11 +809,6 @@ void followThisRay(
     //     int PrevID=RayHeads[i].Prev;
     //     if (PrevID!=-1 && !RayHeads[PrevID].GoUp && !RayHeads[PrevID].IsP && RayHeads[i].GoUp && RayHeads[i].IsP && ans.second) {
     //         RayHeads[i].RemainingLegs=0;
-    //
-    //         unique_lock<mutex> lck(mtx);
-    //         emptySlot.push(mySlot);
-    //         cv.notify_one();
-
     //         return;
     //     }
 
@@ -188,9 +832,23 @@ void followThisRay(
     // Follow the new ray path to see if the new leg enters another region.
     int RayEnd=-1,NextRegion=-1,M=(RayHeads[i].GoLeft?-1:1);
 
-    for (size_t j=0;j<degree.size();++j){
+    // For legs in the 1D reference region, skip the search if no polygon bounds overlap the leg's bounds.
+    bool searchRegions=true;
+    if (CurRegion==0) {
+        double t1=RayHeads[i].Pt,t2=RayHeads[i].Pt+M*degree.back();
+        double r1=R[rIndex(0)],r2=R[rIndex(RayLength-1)];
+        if (t1>t2) swap(t1,t2);
+        if (r1>r2) swap(r1,r2);
+
+        searchRegions=false;
+        for (size_t k=1;k<Regions.size() && !searchRegions;++k)
+            searchRegions=(t1<=RegionBounds[k][1] && RegionBounds[k][0]<=t2 && r1<=RegionBounds[k][3] && RegionBounds[k][2]<=r2);
+        if (!searchRegions) NextRegion=0;
+    }
+
+    for (size_t j=0;j<degree.size() && searchRegions;++j){
 
-        pair<double,double> p={RayHeads[i].Pt+M*degree[j],R[CurRegion][rIndex(j)]}; // point on the newly calculated ray.
+        pair<double,double> p={RayHeads[i].Pt+M*degree[j],R[rIndex(j)]}; // point on the newly calculated ray.
 
         if (CurRegion!=0){ // starts in some 2D polygon ...
 
@@ -250,21 +908,21 @@ void followThisRay(
 
         // For reflection, the future rays start from the last point in the current region (index: RayEnd-1).
         NextPt_R=RayHeads[i].Pt+M*degree[RayEnd-1];
-        NextPr_R=R[CurRegion][rIndex(RayEnd-1)];
+        NextPr_R=R[rIndex(RayEnd-1)];
 
 
         // For transmission/refraction, the futuer rays start from the first point in the next region (index: RayEnd).
         NextPt_T=RayHeads[i].Pt+M*degree[RayEnd];
-        NextPr_T=R[CurRegion][rIndex(RayEnd)];
+        NextPr_T=R[rIndex(RayEnd)];
 
 
         // Re-calculate travel distance and travel time till the last point in the current region.
         ans.first.first=ans.first.second=0;
         for (int j=0;j<RayEnd-1;++j){
-            double dist=sqrt( pow(R[CurRegion][rIndex(j)],2) + pow(R[CurRegion][rIndex(j+1)],2)
-                    -2*R[CurRegion][rIndex(j)]*R[CurRegion][rIndex(j+1)]*cos(M_PI/180*(degree[j+1]-degree[j])) );
+            double dist=sqrt( pow(R[rIndex(j)],2) + pow(R[rIndex(j+1)],2)
+                    -2*R[rIndex(j)]*R[rIndex(j+1)]*cos(M_PI/180*(degree[j+1]-degree[j])) );
             ans.first.second+=dist;
-            ans.first.first+=dist/v[CurRegion][rIndex(j+1)];
+            ans.first.first+=dist/(legV.empty()?dv*v[rIndex(j+1)]:legV[j+1]);
         }
 
 
@@ -296,7 +954,7 @@ void followThisRay(
         double dlx=(p2.first-JuncPt)*M_PI*JuncPr/180,dly=p2.second-JuncPr;
         double dl=sqrt(dlx*dlx+dly*dly);
         ans.first.second+=dl;
-        ans.first.first+=dl/v[CurRegion][rIndex(RayEnd-1)]; // Use the velocit within current region to avoid possible "inf" travel time.
+        ans.first.first+=dl/(legV.empty()?dv*v[rIndex(RayEnd-1)]:legV[RayEnd-1]); // Use the velocit within current region to avoid possible "inf" travel time.
 
 
         // Get the geometry of the boundary.
@@ -312,7 +970,7 @@ void followThisRay(
 
         // Get futuer rays starting point.
         NextPt_T=NextPt_R=RayHeads[i].Pt+M*degree[RayEnd-1];
-        NextPr_T=NextPr_R=R[CurRegion][rIndex(RayEnd-1)];
+        NextPr_T=NextPr_R=R[rIndex(RayEnd-1)];
 
 
         // Notice ray parameter doesn't change if reflection/refraction interface is horizontal.
@@ -320,7 +978,7 @@ void followThisRay(
 
 
         // Get the last segment of the new leg.
-        p2={RayHeads[i].Pt+M*degree[RayEnd-2],R[CurRegion][rIndex(RayEnd-2)]};
+        p2={RayHeads[i].Pt+M*degree[RayEnd-2],R[rIndex(RayEnd-2)]};
         q2={NextPt_T,NextPr_T};
 
         // Get the geometry of the boundary.
@@ -359,23 +1017,34 @@ void followThisRay(
     double rho1,vp1,vs1,rho2,vp2,vs2,c1,c2;;
 
     if (CurRegion!=NextRegion) { // if ray enters a different region.
-        rho1=Rho[CurRegion][rIndex(RayEnd-1)];
-        rho2=Rho[CurRegion][rIndex(RayEnd)]/dRho[CurRegion]*dRho[NextRegion];
-        vp1=Vp[CurRegion][rIndex(RayEnd-1)];
-        vp2=Vp[CurRegion][rIndex(RayEnd)]/dVp[CurRegion]*dVp[NextRegion];
-        vs1=Vs[CurRegion][rIndex(RayEnd-1)];
-        vs2=Vs[CurRegion][rIndex(RayEnd)]/dVs[CurRegion]*dVs[NextRegion];
+        rho1=dRho[CurRegion]*Rho[rIndex(RayEnd-1)];
+        rho2=dRho[NextRegion]*Rho[rIndex(RayEnd)];
+        vp1=dVp[CurRegion]*Vp[rIndex(RayEnd-1)];
+        vp2=dVp[NextRegion]*Vp[rIndex(RayEnd)];
+        vs1=dVs[CurRegion]*Vs[rIndex(RayEnd-1)];
+        vs2=dVs[NextRegion]*Vs[rIndex(RayEnd)];
     }
     else { // if ray stays in the same region. ray ends normally.
         int si=RayEnd;
         if (RayHeads[i].GoUp) --si;
 
-        rho1=Rho[CurRegion][rIndex(si-1)];
-        rho2=Rho[CurRegion][rIndex(si)];
-        vp1=Vp[CurRegion][rIndex(si-1)];
-        vp2=Vp[CurRegion][rIndex(si)];
-        vs1=Vs[CurRegion][rIndex(si-1)];
-        vs2=Vs[CurRegion][rIndex(si)];
+        rho1=dRho[CurRegion]*Rho[rIndex(si-1)];
+        rho2=dRho[CurRegion]*Rho[rIndex(si)];
+        vp1=dVp[CurRegion]*Vp[rIndex(si-1)];
+        vp2=dVp[CurRegion]*Vp[rIndex(si)];
+        vs1=dVs[CurRegion]*Vs[rIndex(si-1)];
+        vs2=dVs[CurRegion]*Vs[rIndex(si)];
+    }
+    // Smooth anomalies scale the properties on the 1D reference side(s).
+    if (Anomalies!=nullptr && CurRegion==0) {
+        vp1*=AnomalyScale(*Anomalies,0,NextPt_R,NextPr_R);
+        vs1*=AnomalyScale(*Anomalies,1,NextPt_R,NextPr_R);
+        rho1*=AnomalyScale(*Anomalies,2,NextPt_R,NextPr_R);
+    }
+    if (Anomalies!=nullptr && NextRegion==0) {
+        vp2*=AnomalyScale(*Anomalies,0,NextPt_T,NextPr_T);
+        vs2*=AnomalyScale(*Anomalies,1,NextPt_T,NextPr_T);
+        rho2*=AnomalyScale(*Anomalies,2,NextPt_T,NextPr_T);
     }
     if (vs1<0.01) Mode[0]='L';
     if (vs2<0.01 && Mode[1]=='S') Mode[1]='L';
@@ -512,21 +1181,19 @@ void followThisRay(
 
 
     // store ray paths.
-    stringstream ss;
+    TextWriter ss(OutputPrecision);
     ss << RayHeads[i].Color << " "
        << (RayHeads[i].IsP?"P ":"S ") << RayHeads[i].TravelTime << " sec. " << RayHeads[i].Inc << " IncDeg. "
        << RayHeads[i].Amp << " DispAmp. " << RayHeads[i].TravelDist << " km. ";
-    string tmpstr=ss.str();
-    RayInfoSize[i]=(int)tmpstr.size()+1;
-    RayInfo[i]=(char *)malloc((tmpstr.size()+1)*sizeof(char));
-    strcpy(RayInfo[i],tmpstr.c_str());
-
-    RaysN[i]=RayEnd;
-    RaysTheta[i]=(double *)malloc(RayEnd*sizeof(double));
-    RaysRadius[i]=(double *)malloc(RayEnd*sizeof(double));
+    Out.RayInfo[i]=move(ss.Buffer);
+    Out.PathHeaders[i]={RayHeads[i].Prev,RayHeads[i].Color,(RayHeads[i].Comp=="P"?0:(RayHeads[i].Comp=="SV"?1:2)),
+                        RayHeads[i].TravelTime,RayHeads[i].Amp};
+
+    Out.RaysTheta[i].resize(RayEnd);
+    Out.RaysRadius[i].resize(RayEnd);
     for (int j=0;j<RayEnd;++j) {
-        RaysTheta[i][j]=RayHeads[i].Pt+M*degree[j];
-        RaysRadius[i][j]=R[CurRegion][rIndex(j)];
+        Out.RaysTheta[i][j]=RayHeads[i].Pt+M*degree[j];
+        Out.RaysRadius[i][j]=R[rIndex(j)];
     }
 
     // If ray reaches surface, output info at the surface.
@@ -543,39 +1210,36 @@ void followThisRay(
             I=RayHeads[I].Prev;
         }
 
-        stringstream ss;
-        ss << RayHeads[hh.back()].Takeoff << " " << RayHeads[i].RayP << " " << RayHeads[i].Inc << " " << NextPt_R << " "
-            << tt << " " << RayHeads[i].Amp << " " << RayHeads[i].RemainingLegs << " " << (RayHeads[i].Turn?"1":"0") << " ";
-        for (auto rit=hh.rbegin();rit!=hh.rend();++rit)
-            ss << (RayHeads[*rit].IsP?(RayHeads[*rit].GoUp?"p":"P"):(RayHeads[*rit].GoUp?"s":"S")) << ((*rit)==*hh.begin()?" ":"->");
+        string phase;
         for (auto rit=hh.rbegin();rit!=hh.rend();++rit)
-            ss << (1+*rit) << ((*rit)==*hh.begin()?"":"->");
+            phase+=string(RayHeads[*rit].IsP?(RayHeads[*rit].GoUp?"p":"P"):(RayHeads[*rit].GoUp?"s":"S"))+((*rit)==*hh.begin()?"":"->");
 
-        string tmpstr=ss.str();
-        if (!tmpstr.empty()) {
-            ReachSurfacesSize[i]=(int)tmpstr.size()+1;
-            ReachSurfaces[i]=(char *)malloc((tmpstr.size()+1)*sizeof(char));
-            strcpy(ReachSurfaces[i],tmpstr.c_str());
+        TextWriter ss(OutputPrecision);
+        ss << RayHeads[hh.back()].Takeoff << " " << RayHeads[i].RayP << " " << RayHeads[i].Inc << " " << NextPt_R << " "
+            << tt << " " << RayHeads[i].Amp << " " << RayHeads[i].RemainingLegs << " " << (RayHeads[i].Turn?"1":"0") << " "
+            << phase << " ";
+        for (auto rit=hh.rbegin();rit!=hh.rend();++rit)
+            ss << (1+RayNumberOffset+*rit) << ((*rit)==*hh.begin()?"":"->");
+
+        // Lineages merged into legs of this ray train: "(train of the merged ray's parent)=>(leg it merged into)".
+        if (Merger!=nullptr) {
+            string merged;
+            for (auto rit=hh.rbegin();rit!=hh.rend();++rit)
+                for (const auto &item: RayHeads[*rit].Merged)
+                    merged+=(merged.empty()?"":";")+item+"=>"+to_string(1+RayNumberOffset+*rit);
+            ss << " " << (merged.empty()?"-":merged);
         }
 
-        if (StopAtSurface==1) {
-
-            unique_lock<mutex> lck(mtx);
-            emptySlot.push(mySlot);
-            cv.notify_one();
+        Out.ReachSurfaces[i]=move(ss.Buffer);
+        Out.Arrivals[i]={RayHeads[hh.back()].Takeoff,RayHeads[i].RayP,RayHeads[i].Inc,NextPt_R,tt,RayHeads[i].Amp,phase};
+        for (auto rit=hh.rbegin();rit!=hh.rend();++rit)
+            Out.ArrivalLegs[i].push_back({RayHeads[*rit].InRegion,RayHeads[*rit].IsP,RayHeads[*rit].TravelTime});
+        Out.ArrivalBranch[i]=RayHeads[i].Branch;
 
-            return;
-        }
+        if (StopAtSurface==1) return;
     }
 
-    if (RayHeads[i].RemainingLegs == 0) {
-
-        unique_lock<mutex> lck(mtx);
-        emptySlot.push(mySlot);
-        cv.notify_one();
-
-        return;
-    }
+    if (RayHeads[i].RemainingLegs == 0) return;
 
 
     // Add rules of: (t)ransmission/refrection and (r)eflection to (s)ame or (d)ifferent way type.
@@ -604,6 +1268,49 @@ void followThisRay(
 
     // Add new ray heads to "RayHeads" according to the rules ans reflection/refraction angle calculation results.
 
+    /// If merging coincident rays, a new ray practically identical to an existing, not yet traced ray
+    /// (same position, ray parameter, wave type, direction, region, remaining legs and arrival time)
+    /// is not added. Its amplitude is added to the existing one and its lineage is recorded there.
+    double startTime=0;
+    string lineage;
+    if (Merger!=nullptr) {
+        for (int I=(int)i;I!=-1;I=RayHeads[I].Prev) {
+            startTime+=RayHeads[I].TravelTime;
+            lineage=to_string(1+RayNumberOffset+I)+(lineage.empty()?"":"->")+lineage;
+        }
+    }
+
+    /// In the second pass of two-pass tracing, only rays on the surviving branches are added.
+    auto addRay=[&](Ray &newRay, const char &branch){
+
+        newRay.Branch+=branch;
+        if (Survivors!=nullptr && Survivors->find(newRay.Branch)==Survivors->end()) return;
+
+        newRay.Merged.clear();
+        newRay.MergedBranch.clear();
+        if (Merger==nullptr) {
+            RayHeads[finalSize.fetch_add(1)]=newRay;
+            return;
+        }
+
+        auto q=[&MergeTolerance](const double &x){return (long long)llround(x/MergeTolerance);};
+        vector<long long> key{newRay.IsP,newRay.GoUp,newRay.GoLeft,newRay.Turn,
+                              (newRay.Comp=="P"?0:(newRay.Comp=="SV"?1:2)),newRay.InRegion,newRay.RemainingLegs,
+                              newRay.Surfacing,newRay.Color,q(newRay.Pt),q(newRay.Pr),q(newRay.RayP),q(startTime)};
+
+        unique_lock<mutex> lck(Merger->Mtx);
+        auto it=Merger->find(key);
+        if (it!=Merger->end() && it->second>=Dispatched) {
+            RayHeads[it->second].Amp+=newRay.Amp;
+            RayHeads[it->second].Merged.push_back(lineage);
+            RayHeads[it->second].MergedBranch.push_back(newRay.Branch);
+            return;
+        }
+        size_t k=finalSize.fetch_add(1);
+        RayHeads[k]=newRay;
+        (*Merger)[key]=k;
+    };
+
     if (ts) {
         Ray newRay=RayHeads[i];
         newRay.Prev=(int)i;
@@ -616,7 +1323,7 @@ void followThisRay(
         double sign1=(T_PP.imag()==0?(T_PP.real()<0?-1:1):1);
         double sign2=(T_SS.imag()==0?(T_SS.real()<0?-1:1):1);
         newRay.Amp*=(newRay.IsP?(sign1*abs(T_PP)):(sign2*abs(T_SS)));
-        RayHeads[finalSize.fetch_add(1)]=newRay;
+        addRay(newRay,'t');
     }
 
     if (td) {
@@ -633,7 +1340,7 @@ void followThisRay(
         double sign2=(T_SP.imag()==0?(T_SP.real()<0?-1:1):1);
         newRay.Amp*=(newRay.IsP?(sign2*abs(T_SP)):(sign1*abs(T_PS)));
         newRay.Comp=(newRay.IsP?"P":"SV");
-        RayHeads[finalSize.fetch_add(1)]=newRay;
+        addRay(newRay,'d');
     }
 
     if (rd) {
@@ -649,7 +1356,7 @@ void followThisRay(
         double sign2=(R_SP.imag()==0?(R_SP.real()<0?-1:1):1);
         newRay.Amp*=(newRay.IsP?(sign2*abs(R_SP)):(sign1*abs(R_PS)));
         newRay.Comp=(newRay.IsP?"P":"SV");
-        RayHeads[finalSize.fetch_add(1)]=newRay;
+        addRay(newRay,'r');
     }
 
     // rs is always possible.
@@ -664,269 +1371,1589 @@ void followThisRay(
         double sign1=(R_PP.imag()==0?(R_PP.real()<0?-1:1):1);
         double sign2=(R_SS.imag()==0?(R_SS.real()<0?-1:1):1);
         newRay.Amp*=(newRay.IsP?(sign1*abs(R_PP)):(sign2*abs(R_SS)));
-        RayHeads[finalSize.fetch_add(1)]=newRay;
+        addRay(newRay,'s');
     }
 
-    unique_lock<mutex> lck(mtx);
-    emptySlot.push(mySlot);
-    cv.notify_one();
-
     return;
 }
 
-void PreprocessAndRun (
+// 64-bit FNV-1a hash of arrays. (sizes included)
+class FNVHash {
+    public:
+        uint64_t Key=14695981039346656037ULL;
 
-        const vector<int> &initRaySteps,const vector<int> &initRayComp,const vector<int> &initRayColor,
-        const vector<double> &initRayTheta,const vector<double> &initRayDepth,const vector<double> &initRayTakeoff,
+        void add(const void *p, const size_t &n){
+            for (size_t i=0;i<n;++i) {
+                Key^=((const unsigned char *)p)[i];
+                Key*=1099511628211ULL;
+            }
+        }
+        void add(const vector<double> &a){
+            uint64_t n=a.size();
+            add(&n,sizeof(n));
+            add(a.data(),n*sizeof(double));
+        }
+        void add(const vector<vector<double>> &a){
+            uint64_t n=a.size();
+            add(&n,sizeof(n));
+            for (const auto &item:a) add(item);
+        }
+};
+
+// Preprocessed model cache.
+// The cache file name is the prefix followed by a 64-bit FNV-1a hash of everything "PreprocessModel" depends on
+// (source depths only if the adaptive grid is used).
+//
+// File layout (all 8-byte words):
+// "RAYMODEL", format version, key, nR, nRegion (including region 0), nPoints (total rectified polygon points),
+// polygon sizes (nRegion, uint64), then doubles: R, Vp, Vs, Rho (nR each), RegionBounds (4 per region),
+// dVp, dVs, dRho (nRegion each), polygons (theta, radius pairs).
+const uint64_t ModelCacheMagic=0x4c45444f4d594152ULL; // "RAYMODEL"
+const uint64_t ModelCacheVersion=1;
+
+string ModelCacheFile(
+        const string &ModelCachePrefix, const vector<double> &initRayDepth,
         const vector<double> &gridDepth1,const vector<double> &gridDepth2,const vector<double> &gridInc,
         const vector<double> &specialDepths,const vector<vector<double>> &Deviation,
         const vector<vector<double>> &regionProperties,
         const vector<vector<double>> &regionPolygonsTheta,
         const vector<vector<double>> &regionPolygonsDepth,
+        const double &RectifyLimit, const double &AdaptiveGridMargin, const double &AdaptiveGridInc, uint64_t &key) {
+
+    FNVHash H;
+    H.add(&ModelCacheVersion,sizeof(ModelCacheVersion));
+    H.add(gridDepth1);
+    H.add(gridDepth2);
+    H.add(gridInc);
+    H.add(specialDepths);
+    H.add(Deviation);
+    H.add(regionProperties);
+    H.add(regionPolygonsTheta);
+    H.add(regionPolygonsDepth);
+    H.add({RectifyLimit,AdaptiveGridMargin});
+    if (AdaptiveGridMargin>0) {
+        set<double> sourceDepths(initRayDepth.begin(),initRayDepth.end());
+        H.add(vector<double> {AdaptiveGridInc});
+        H.add(vector<double> (sourceDepths.begin(),sourceDepths.end()));
+    }
+    key=H.Key;
 
-        const double &RectifyLimit, const bool &TS, const bool &TD, const bool &RS, const bool &RD,
-        const size_t &nThread, const bool &DebugInfo, const bool &StopAtSurface,
-        const size_t &branches, const size_t &potentialSize,
+    stringstream ss;
+    ss << ModelCachePrefix << hex << setw(16) << setfill('0') << key;
+    return ss.str();
+}
 
-        char **ReachSurfaces, int *ReachSurfacesSize, char **RayInfo, int *RayInfoSize,
-        int *RegionN,double **RegionsTheta,double **RegionsRadius,
-        double **RaysTheta, int *RaysN, double **RaysRadius,int *Observer) {
+// Read the model from a cache file (memory mapped). Returns false if the file is missing or doesn't match "key".
+// The tables are copied out of the mapping on purpose: the tracer and the "RayPath" kernels take them as std::vector,
+// which can't refer to mapped memory. Each table is one contiguous copy (no parsing), the saving of the cache is the
+// skipped preprocessing (grid and polygon rectification). The mapping is released before returning.
+bool LoadModelCache(
+        const string &file, const uint64_t &key,
+        vector<double> &R, vector<double> &Vp, vector<double> &Vs, vector<double> &Rho,
+        vector<vector<pair<double,double>>> &Regions, vector<vector<double>> &RegionBounds,
+        vector<double> &dVp, vector<double> &dVs, vector<double> &dRho) {
+
+    int fd=open(file.c_str(),O_RDONLY);
+    if (fd<0) return false;
+    struct stat st;
+    if (fstat(fd,&st)!=0 || (size_t)st.st_size<6*sizeof(uint64_t)) {
+        close(fd);
+        return false;
+    }
+    size_t fileSize=st.st_size;
+    void *addr=mmap(nullptr,fileSize,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (addr==MAP_FAILED) return false;
+
+    const uint64_t *header=(const uint64_t *)addr;
+    uint64_t nR=header[3],nRegion=header[4],nPoints=header[5];
+    bool ok=(header[0]==ModelCacheMagic && header[1]==ModelCacheVersion && header[2]==key && nRegion>0 &&
+             nR<fileSize && nRegion<fileSize && nPoints<fileSize && fileSize==(6+nRegion+4*nR+7*nRegion+2*nPoints)*8);
+
+    // region sizes must add up to "nPoints", or the region loop reads past the mapping. (Region[0] is the 1D reference)
+    const uint64_t *sizes=header+6;
+    if (ok) ok=(sizes[0]==0 && all_of(sizes,sizes+nRegion,[&](const uint64_t &n){return n<=nPoints;}) &&
+                accumulate(sizes,sizes+nRegion,(uint64_t)0)==nPoints);
+
+    if (ok) {
+        const double *p=(const double *)(sizes+nRegion);
+        auto take=[&p](vector<double> &a, size_t n){
+            a.assign(p,p+n);
+            p+=n;
+        };
+        take(R,nR);
+        take(Vp,nR);
+        take(Vs,nR);
+        take(Rho,nR);
+        RegionBounds.resize(nRegion);
+        for (auto &item:RegionBounds) take(item,4);
+        take(dVp,nRegion);
+        take(dVs,nRegion);
+        take(dRho,nRegion);
+        Regions.assign(nRegion,vector<pair<double,double>> ());
+        for (size_t i=0;i<nRegion;++i) {
+            Regions[i].reserve(sizes[i]);
+            for (size_t j=0;j<sizes[i];++j,p+=2) Regions[i].emplace_back(p[0],p[1]);
+        }
+    }
 
-    // Ray nodes.
-    vector<Ray> RayHeads;
-    if (potentialSize > RayHeads.max_size()) {
-        throw runtime_error("Too many rays to handle: decrease the number of legs or the number of input rays...");
+    munmap(addr,fileSize);
+    return ok;
+}
+
+// Write the model to a cache file. (written to a temporary file first, then renamed, so concurrent runs
+// never see a partial file) Failures are ignored: the model is just preprocessed again next time.
+void SaveModelCache(
+        const string &file, const uint64_t &key,
+        const vector<double> &R, const vector<double> &Vp, const vector<double> &Vs, const vector<double> &Rho,
+        const vector<vector<pair<double,double>>> &Regions, const vector<vector<double>> &RegionBounds,
+        const vector<double> &dVp, const vector<double> &dVs, const vector<double> &dRho) {
+
+    vector<uint64_t> header{ModelCacheMagic,ModelCacheVersion,key,R.size(),Regions.size(),0};
+    for (const auto &item:Regions) header[5]+=item.size();
+    for (const auto &item:Regions) header.push_back(item.size());
+
+    string tmpFile=file+".tmp"+to_string(getpid());
+    ofstream fpout(tmpFile,ios::binary);
+    auto put=[&fpout](const vector<double> &a){
+        fpout.write((const char *)a.data(),a.size()*sizeof(double));
+    };
+    fpout.write((const char *)header.data(),header.size()*sizeof(uint64_t));
+    for (const auto &a: {&R,&Vp,&Vs,&Rho}) put(*a);
+    for (const auto &item:RegionBounds) put(item);
+    for (const auto &a: {&dVp,&dVs,&dRho}) put(*a);
+    for (const auto &item:Regions)
+        for (const auto &point:item) put({point.first,point.second});
+    fpout.close();
+
+    if (!fpout || rename(tmpFile.c_str(),file.c_str())!=0) remove(tmpFile.c_str());
+}
+
+// Rectify one input polygon, and find its bounds {theta min, theta max, radius min, radius max}.
+// Radius bounds are moved to the closest layers in R, so the polygon uses the 1D reference layers within its bounds.
+void RectifyPolygon(const vector<double> &polygonTheta, const vector<double> &polygonDepth,
+                    const vector<double> &R, const double &RectifyLimit,
+                    vector<pair<double,double>> &Region, vector<double> &Bounds){
+
+    // Find the bounds of input polygon.
+    double Xmin=numeric_limits<double>::max(),Xmax=-Xmin,Ymin=Xmin,Ymax=-Ymin;
+    for (size_t j=0;j<polygonTheta.size();++j){
+        size_t k=(j+1)%polygonTheta.size();
+        double theta1=polygonTheta[j],theta2=polygonTheta[k];
+        double radius1=_RE-polygonDepth[j],radius2=_RE-polygonDepth[k];
+
+        Xmin=min(Xmin,theta1);Xmax=max(Xmax,theta2);
+        Ymin=min(Ymin,radius1);Ymax=max(Ymax,radius2);
     }
-    if (initRaySteps.empty()) {
-        return;
+
+
+    // Find the closest layer value in R to Ymin/Ymax.
+    size_t adjustedYmin=findClosetLayer(R,Ymin),adjustedYmax=findClosetLayer(R,Ymax);
+
+
+    // Rectify input polygon.
+    Region.clear();
+    for (size_t j=0;j<polygonTheta.size();++j){
+
+        // Find the fine enough rectify for this section.
+        size_t k=(j+1)%polygonTheta.size();
+        double radius1=_RE-polygonDepth[j],radius2=_RE-polygonDepth[k];
+        double theta1=polygonTheta[j],theta2=polygonTheta[k];
+
+        if (radius1==Ymin) radius1=R[adjustedYmin];
+        if (radius1==Ymax) radius1=R[adjustedYmax];
+        if (radius2==Ymin) radius2=R[adjustedYmin];
+        if (radius2==Ymax) radius2=R[adjustedYmax];
+
+        double Tdist=theta2-theta1,Rdist=radius2-radius1;
+
+        size_t NPTS=2;
+        double dL=_RE,dR=Rdist,dT=Tdist;
+        while (dL>RectifyLimit){
+            NPTS*=2;
+            dR=Rdist/(NPTS-1);
+            dT=Tdist/(NPTS-1);
+            dL=LocDist(theta1,0,radius1,theta1+dT,0,radius1+dR);
+        }
+
+        // Add rectified segments to this polygon.
+        for (size_t k=0;k+1<NPTS;++k)
+            Region.push_back(make_pair(theta1+k*dT,radius1+k*dR));
     }
 
-    // Create 1D reference layers. (R[0]. 0 means 1D reference model)
+    // adjust bounds to the values in R.
+    Bounds={Xmin,Xmax,R[adjustedYmin],R[adjustedYmax]};
+}
+
+// Preprocess the model: 1D reference layers (R) and their properties, rectified polygons (Regions), their bounds and
+// property scales. "initRayDepth" is only used by the adaptive grid.
+void PreprocessModel(
+        const vector<double> &initRayDepth,
+        const vector<double> &gridDepth1,const vector<double> &gridDepth2,const vector<double> &gridInc,
+        const vector<double> &specialDepths,const vector<vector<double>> &Deviation,
+        const vector<vector<double>> &regionProperties,
+        const vector<vector<double>> &regionPolygonsTheta,
+        const vector<vector<double>> &regionPolygonsDepth,
+        const double &RectifyLimit, const double &AdaptiveGridMargin, const double &AdaptiveGridInc, const size_t &nThread,
+        vector<double> &R, vector<double> &Vp, vector<double> &Vs, vector<double> &Rho,
+        vector<vector<pair<double,double>>> &Regions, vector<vector<double>> &RegionBounds,
+        vector<double> &dVp, vector<double> &dVs, vector<double> &dRho) {
 
-    vector<vector<double>> R(1);
+    // Create 1D reference layers.
+    R.clear();
     for (size_t i=0;i<gridDepth1.size();++i){
         auto tmpr=CreateGrid(_RE-gridDepth2[i],_RE-gridDepth1[i],gridInc[i],2);
-        if (!R[0].empty()) R[0].pop_back();
-        R[0].insert(R[0].end(),tmpr.rbegin(),tmpr.rend());
+        if (!R.empty()) R.pop_back();
+        R.insert(R.end(),tmpr.rbegin(),tmpr.rend());
+    }
+
+    // Adaptive grid: keep the grid above only within "AdaptiveGridMargin" of special depths, source depths,
+    // 1D deviation boundaries and polygon depth spans. Elsewhere, thin it out to about "AdaptiveGridInc".
+    // Grid points on both sides of other velocity/density jumps (e.g. PREM 220, 400, 670) are also kept.
+    if (AdaptiveGridMargin>0 && R.size()>2) {
+
+        vector<bool> jump(R.size(),false);
+        vector<double> tmpVp,tmpVs,tmpRho;
+        MakeRefLayers(R,Deviation,tmpVp,tmpVs,tmpRho,nThread);
+        for (size_t i=1;i<R.size();++i)
+            for (const auto &v: {&tmpVp,&tmpVs,&tmpRho})
+                if (fabs((*v)[i]-(*v)[i-1])>0.005*max(fabs((*v)[i]),fabs((*v)[i-1]))) jump[i-1]=jump[i]=true;
+
+        vector<pair<double,double>> fineZones;
+        for (const auto &item:specialDepths) fineZones.push_back({item-AdaptiveGridMargin,item+AdaptiveGridMargin});
+        for (const auto &item:initRayDepth) fineZones.push_back({item-AdaptiveGridMargin,item+AdaptiveGridMargin});
+        for (const auto &item:Deviation) {
+            fineZones.push_back({item[0]-AdaptiveGridMargin,item[0]+AdaptiveGridMargin});
+            fineZones.push_back({item[1]-AdaptiveGridMargin,item[1]+AdaptiveGridMargin});
+        }
+        for (const auto &item:regionPolygonsDepth) {
+            if (item.empty()) continue;
+            auto mm=minmax_element(item.begin(),item.end());
+            fineZones.push_back({*mm.first-AdaptiveGridMargin,*mm.second+AdaptiveGridMargin});
+        }
+
+        vector<double> thinned{R[0]};
+        for (size_t i=1;i+1<R.size();++i) {
+            double depth=_RE-R[i];
+            bool keep=(jump[i] || thinned.back()-R[i]>=AdaptiveGridInc);
+            for (size_t j=0;j<fineZones.size() && !keep;++j)
+                keep=(fineZones[j].first<=depth && depth<=fineZones[j].second);
+            if (keep) thinned.push_back(R[i]);
+        }
+        thinned.push_back(R.back());
+        swap(R,thinned);
     }
 
 
     // Fix round-off-errors:
-    // adding the exact double values in A. special depths and B. modefied 1D model to R[0].
+    // adding the exact double values in A. special depths and B. modefied 1D model to R.
     set<double> depthToCorrect(specialDepths.begin(),specialDepths.end());
     for (const auto &item:Deviation) {
         depthToCorrect.insert(item[0]);
         depthToCorrect.insert(item[1]);
     }
     vector<double> tmpArray;
-    swap(R[0],tmpArray);
+    swap(R,tmpArray);
     tmpArray[0]=_RE;tmpArray.back()=0;
     auto it=depthToCorrect.begin();
     for (int i=0;i<(int)tmpArray.size();++i) {
         if (it==depthToCorrect.end())
-            R[0].push_back(tmpArray[i]);
+            R.push_back(tmpArray[i]);
         else if (tmpArray[i]==_RE-*it) {
-            R[0].push_back(tmpArray[i]);
+            R.push_back(tmpArray[i]);
             ++it;
         }
         else if (tmpArray[i]>_RE-*it) {
-            R[0].push_back(tmpArray[i]);
+            R.push_back(tmpArray[i]);
         }
         else {
-            R[0].push_back(_RE-*it);
+            R.push_back(_RE-*it);
             ++it;
             --i;
         }
     }
     while (it!=depthToCorrect.end()){
-        R[0].push_back(_RE-*it);
+        R.push_back(_RE-*it);
         ++it;
     }
 
-    // Find the bounds of input polygons.
-    vector<vector<double>> RegionBounds{{-numeric_limits<double>::max(),numeric_limits<double>::max(),
+    // Rectify input polygons.
+    RegionBounds={{-numeric_limits<double>::max(),numeric_limits<double>::max(),
         -numeric_limits<double>::max(),numeric_limits<double>::max()}};
     // the 1D reference bounds is as large as possible.
+    Regions.assign(1,vector<pair<double,double>> ()); // place holder for Region[0], which is the 1D reference.
 
     for (size_t i=0;i<regionPolygonsTheta.size();++i){
-        double Xmin=numeric_limits<double>::max(),Xmax=-Xmin,Ymin=Xmin,Ymax=-Ymin;
-        for (size_t j=0;j<regionPolygonsTheta[i].size();++j){
-            size_t k=(j+1)%regionPolygonsTheta[i].size();
-            double theta1=regionPolygonsTheta[i][j],theta2=regionPolygonsTheta[i][k];
-            double radius1=_RE-regionPolygonsDepth[i][j],radius2=_RE-regionPolygonsDepth[i][k];
+        Regions.push_back(vector<pair<double,double>> ());
+        RegionBounds.push_back(vector<double> ());
+        RectifyPolygon(regionPolygonsTheta[i],regionPolygonsDepth[i],R,RectifyLimit,Regions.back(),RegionBounds.back());
+    }
 
-            Xmin=min(Xmin,theta1);Xmax=max(Xmax,theta2);
-            Ymin=min(Ymin,radius1);Ymax=max(Ymax,radius2);
-        }
-        RegionBounds.push_back({Xmin,Xmax,Ymin,Ymax});
+    // properties for these polygon.
+    // Layers of polygons are not copied: a polygon uses the 1D reference layers within its bounds (RegionBounds),
+    // with properties scaled by these factors.
+    dVp={1};dVs={1};dRho={1}; // Region 0 has dVp=1 ,...
+    for (size_t i=0;i<regionPolygonsTheta.size();++i) {
+        dVp.push_back(1.0+regionProperties[i][0]/100);
+        dVs.push_back(1.0+regionProperties[i][1]/100);
+        dRho.push_back(1.0+regionProperties[i][2]/100);
     }
 
+    // derive properties layers for the 1D reference.
+    MakeRefLayers(R,Deviation,Vp,Vs,Rho,nThread);
+}
 
-    // Find the closest layer value in R[0] to Ymin/Ymax of each polygon.
-    vector<size_t> adjustedYmin{0},adjustedYmax{0};
-    for (size_t i=0;i<regionPolygonsTheta.size();++i){
-        adjustedYmin.push_back(findClosetLayer(R[0],RegionBounds[i+1][2]));
-        adjustedYmax.push_back(findClosetLayer(R[0],RegionBounds[i+1][3]));
+Tracer::Tracer(
+        const vector<double> &gridDepth1,const vector<double> &gridDepth2,const vector<double> &gridInc,
+        const vector<double> &specialDepths,const vector<vector<double>> &Deviation,
+        const vector<vector<double>> &regionProperties,
+        const vector<vector<double>> &regionPolygonsTheta,
+        const vector<vector<double>> &regionPolygonsDepth,
+        const double &RectifyLimit, const double &AdaptiveGridMargin, const double &AdaptiveGridInc,
+        const vector<double> &sourceDepths, const size_t &nThread, const string &ModelCachePrefix,
+        const vector<SmoothAnomaly> &Anomalies) :
+        specialDepths(specialDepths), Deviation(Deviation), Anomalies(Anomalies), RectifyLimit(RectifyLimit) {
+
+    // Preprocessed model. (read from the model cache if possible)
+    uint64_t key=0;
+    string CacheFile;
+    if (ModelCachePrefix!="NONE")
+        CacheFile=ModelCacheFile(ModelCachePrefix,sourceDepths,gridDepth1,gridDepth2,gridInc,specialDepths,Deviation,
+                                 regionProperties,regionPolygonsTheta,regionPolygonsDepth,
+                                 RectifyLimit,AdaptiveGridMargin,AdaptiveGridInc,key);
+
+    if (CacheFile.empty() || !LoadModelCache(CacheFile,key,R,Vp,Vs,Rho,Regions,RegionBounds,dVp,dVs,dRho)) {
+        PreprocessModel(sourceDepths,gridDepth1,gridDepth2,gridInc,specialDepths,Deviation,
+                        regionProperties,regionPolygonsTheta,regionPolygonsDepth,
+                        RectifyLimit,AdaptiveGridMargin,AdaptiveGridInc,nThread,
+                        R,Vp,Vs,Rho,Regions,RegionBounds,dVp,dVs,dRho);
+        if (!CacheFile.empty()) SaveModelCache(CacheFile,key,R,Vp,Vs,Rho,Regions,RegionBounds,dVp,dVs,dRho);
     }
 
+    // Identify the 1D reference layers, for incremental tracing.
+    FNVHash H;
+    for (const auto &a: {&R,&Vp,&Vs,&Rho,&this->specialDepths}) H.add(*a);
+    H.add(Deviation);
+    for (const auto &item:Anomalies)
+        H.add(vector<double> {item.Theta,item.Depth,item.ThetaWidth,item.DepthWidth,item.dVp,item.dVs,item.dRho});
+    LayerKey=H.Key;
+}
 
-    // Rectify input polygons. And derived the polygon layers from the layers of the 1D reference:
-    vector<pair<double,double>> tmpRegion;
-    vector<vector<pair<double,double>>> Regions{tmpRegion}; // place holder for Region[0], which is the 1D reference.
+TraceResult Tracer::trace(const TraceBatch &Batch) const {
+    return traceModel(Batch,Regions,RegionBounds,dVp,dVs,dRho);
+}
 
-    for (size_t i=0;i<regionPolygonsTheta.size();++i){
+TraceResult Tracer::trace(const TraceBatch &Batch, const size_t &region, const vector<double> &properties,
+                          const vector<double> &polygonTheta, const vector<double> &polygonDepth,
+                          vector<pair<double,double>> &Rectified) const {
+
+    if (region==0 || region>=Regions.size()) throw runtime_error("Scenario error: region "+to_string(region)+" doesn't exist ...");
+
+    // Only this region is rebuilt, the 1D reference layers are shared.
+    auto newRegions=Regions;
+    auto newRegionBounds=RegionBounds;
+    auto newdVp=dVp,newdVs=dVs,newdRho=dRho;
+    RectifyPolygon(polygonTheta,polygonDepth,R,RectifyLimit,newRegions[region],newRegionBounds[region]);
+    newdVp[region]=1.0+properties[0]/100;
+    newdVs[region]=1.0+properties[1]/100;
+    newdRho[region]=1.0+properties[2]/100;
+
+    Rectified=newRegions[region];
+    return traceModel(Batch,newRegions,newRegionBounds,newdVp,newdVs,newdRho);
+}
+
+// Trace with these regions. (the model's own regions or scenario ones)
+TraceResult Tracer::traceModel(const TraceBatch &Batch,
+                               const vector<vector<pair<double,double>>> &Regions, const vector<vector<double>> &RegionBounds,
+                               const vector<double> &dVp, const vector<double> &dVs, const vector<double> &dRho) const {
+
+    // Estimate the output size.
+    int branches=(Batch.TS+Batch.TD+Batch.RS+Batch.RD);
+    size_t potentialSize=PotentialSize(Batch.initRaySteps,branches);
+
+    // Ray nodes.
+    vector<Ray> RayHeads;
+    if (potentialSize > RayHeads.max_size()) {
+        throw runtime_error("Too many rays to handle: decrease the number of legs or the number of input rays...");
+    }
+    TraceResult Out(potentialSize);
+    if (Batch.initRaySteps.empty()) {
+        return Out;
+    }
+
+    // Two-pass tracing. Pass one traces the whole ray tree on a coarser grid: every "TwoPass"-th grid point of R,
+    // plus the special depths, 1D deviation boundaries, polygon bounds and both sides of property jumps.
+    // Branches leading to rays that reach the surface (and branches merged into them) survive.
+    // Pass two traces only the surviving branches on the full grid.
+    vector<double> Rc,Vpc,Vsc,Rhoc;
+    if (Batch.TwoPass>1) {
+
+        set<double> keepR;
+        for (const auto &item:specialDepths) keepR.insert(_RE-item);
+        for (const auto &item:Deviation) {
+            keepR.insert(_RE-item[0]);
+            keepR.insert(_RE-item[1]);
+        }
+        for (size_t i=1;i<RegionBounds.size();++i) {
+            keepR.insert(RegionBounds[i][2]);
+            keepR.insert(RegionBounds[i][3]);
+        }
 
-        tmpRegion.clear();
-        for (size_t j=0;j<regionPolygonsTheta[i].size();++j){
+        vector<bool> jump(R.size(),false);
+        for (size_t j=1;j<R.size();++j)
+            for (const auto &v: {&Vp,&Vs,&Rho})
+                if (fabs((*v)[j]-(*v)[j-1])>0.005*max(fabs((*v)[j]),fabs((*v)[j-1]))) jump[j-1]=jump[j]=true;
+
+        for (size_t j=0;j<R.size();++j) {
+            if (j%Batch.TwoPass==0 || j+1==R.size() || jump[j] || keepR.count(R[j])) {
+                Rc.push_back(R[j]);
+                Vpc.push_back(Vp[j]);
+                Vsc.push_back(Vs[j]);
+                Rhoc.push_back(Rho[j]);
+            }
+        }
+    }
+
+    // Trace the ray tree for the given layers.
+    // (with "Survivors", only rays on these branches are traced)
+    auto runTree=[&](const vector<double> &R, const vector<double> &Vp, const vector<double> &Vs, const vector<double> &Rho,
+                     const set<string> *Survivors, const size_t &BeamWidth){
+
+        RayHeads.clear();
+
+        // Create initial rays.
+        for (size_t i=0;i<Batch.initRaySteps.size();++i){
+
+            // Source in any polygons?
+            size_t rid=0;
+            for (size_t i=1;i<Regions.size();++i)
+                if (PointInPolygon(Regions[i],make_pair(Batch.initRayTheta[i],_RE-Batch.initRayDepth[i]),1,RegionBounds[i])) {rid=i;break;}
+
+            // Calculate ray parameter.
+            auto ans=MakeRef(Batch.initRayDepth[i],Deviation);
+            double v=(Batch.initRayComp[i]==0?ans[0]*dVp[rid]:ans[1]*dVs[rid]);
+            if (Batch.LayerIntegrator==2 && rid==0)
+                v*=AnomalyScale(Anomalies,(Batch.initRayComp[i]==0?0:1),Batch.initRayTheta[i],_RE-Batch.initRayDepth[i]);
+            double rayp=M_PI/180*(_RE-Batch.initRayDepth[i])*sin(fabs(Batch.initRayTakeoff[i])/180*M_PI)/v;
+
+            // Push this ray into "RayHeads" for future processing.
+            RayHeads.push_back(Ray(Batch.initRayComp[i]==0,fabs(Batch.initRayTakeoff[i])>=90,Batch.initRayTakeoff[i]<0,
+                        (Batch.initRayComp[i]==0?"P":(Batch.initRayComp[i]==1?"SV":"SH")),
+                        (int)rid,Batch.initRaySteps[i],Batch.initRayColor[i],
+                        Batch.initRayTheta[i],_RE-Batch.initRayDepth[i],0,0,rayp,Batch.initRayTakeoff[i]));
+            RayHeads.back().Branch=to_string(i)+":";
+        }
+
+        atomic<size_t> finalSize;
+        finalSize.store(RayHeads.size());
+        RayHeads.resize(potentialSize);
+
+        // 1D reference legs cache, shared by all threads.
+        LegCache Cache(Batch.LegCacheRaypInc);
+
+        // Coincident rays merging map, shared by all threads.
+        MergeMap Merger;
+
+        // Start ray tracing. (Finally!)
+        //
+        // Process each "Ray" leg in "RayHeads".
+        // For future legs generated by reflction/refraction, create new "Ray" and assign it to the proper position in "RayHeads" vector.
+        auto traceLeg=[&](size_t k, const size_t &Dispatched, const LegCache::Leg *Precomputed){
+            followThisRay(k, finalSize,
+                Out, RayHeads, branches, specialDepths,
+                R, Vp, Vs, Rho,
+                Regions, RegionBounds, dVp, dVs, dRho,
+                Batch.DebugInfo, Batch.TS, Batch.TD, Batch.RS, Batch.RD, Batch.StopAtSurface,
+                (Batch.UseLegCache?&Cache:nullptr), (Batch.MergeRays?&Merger:nullptr), Batch.MergeTolerance, Dispatched, Precomputed, Batch.LayerIntegrator, Survivors,
+                Batch.RayNumberOffset, (Batch.LayerIntegrator==2 && !Anomalies.empty()?&Anomalies:nullptr), Batch.OutputPrecision);
+        };
+
+        // Trace a group of legs sharing region, wave type and depth range with "RayPathBundle".
+        auto traceBundle=[&](const vector<size_t> &group, const size_t &Dispatched){
+
+            if (group.size()==1) {
+                traceLeg(group[0],Dispatched,nullptr);
+                return;
+            }
 
-            // Find the fine enough rectify for this section.
-            size_t k=(j+1)%regionPolygonsTheta[i].size();
-            double radius1=_RE-regionPolygonsDepth[i][j],radius2=_RE-regionPolygonsDepth[i][k];
-            double theta1=regionPolygonsTheta[i][j],theta2=regionPolygonsTheta[i][k];
+            const Ray &first=RayHeads[group[0]];
+            double Top,Bot,rayp[_RAYBUNDLE];
+            findLegDepths(first,specialDepths,RegionBounds,Top,Bot);
+            bool useCache=(Batch.UseLegCache && first.InRegion==0);
+            for (size_t j=0;j<group.size();++j)
+                rayp[j]=(useCache?Cache.keyRayp(RayHeads[group[j]].RayP):RayHeads[group[j]].RayP);
+
+            vector<LegCache::Leg> legs(group.size());
+            const auto &v=(first.IsP?Vp:Vs);
+            const double dv=(first.IsP?dVp:dVs)[first.InRegion];
+            if (Batch.LayerIntegrator==0) {
+                size_t first,last;
+                findLegLayers(R,Top,Bot,first,last);
+                vector<double> legR(R.begin()+first,R.begin()+last+1),legV(v.begin()+first,v.begin()+last+1);
+                for (size_t j=0;j<group.size();++j) rayp[j]*=dv;
+                RayPathBundle(legR,legV,rayp,group.size(),Top,Bot,legs.data(),_TURNINGANGLE);
+                for (size_t j=0;j<group.size();++j) {
+                    if (!legs[j].Degree.empty()) legs[j].LastRadiusIndex+=first;
+                    legs[j].Ans.first.first/=dv;
+                }
+            }
+            else for (size_t j=0;j<group.size();++j)
+                legs[j].Ans=tracePath(Batch.LayerIntegrator,R,v,dv,rayp[j],Top,Bot,legs[j].Degree,legs[j].LastRadiusIndex);
 
-            if (radius1==RegionBounds[i+1][2]) radius1=R[0][adjustedYmin[i+1]];
-            if (radius1==RegionBounds[i+1][3]) radius1=R[0][adjustedYmax[i+1]];
-            if (radius2==RegionBounds[i+1][2]) radius2=R[0][adjustedYmin[i+1]];
-            if (radius2==RegionBounds[i+1][3]) radius2=R[0][adjustedYmax[i+1]];
+            for (size_t j=0;j<group.size();++j) {
+                if (useCache) Cache.insert(RayHeads[group[j]].IsP,RayHeads[group[j]].RayP,Top,Bot,make_shared<LegCache::Leg>(legs[j]));
+                traceLeg(group[j],Dispatched,&legs[j]);
+            }
+        };
+
+        if (Batch.Wavefront || BeamWidth>0) {
+
+            // Generation-by-generation: legs in "RayHeads" of the same generation (leg depth) are contiguous.
+            // Each generation is sorted by region and wave type, then traced as one parallel batch.
+            // With beam search, after each generation, keep only the "BeamWidth" children with the largest |Amp|.
+            size_t genBegin=0,genEnd=finalSize.load();
+
+            while (genBegin<genEnd) {
+
+                // Nothing refers to legs of this generation yet (their parents are done, their children don't exist),
+                // so they can be re-ordered. Pruned legs go to the end.
+                stable_sort(RayHeads.begin()+genBegin,RayHeads.begin()+genEnd,[](const Ray &a, const Ray &b){
+                    return make_tuple(a.RemainingLegs==0,a.InRegion,a.IsP)<make_tuple(b.RemainingLegs==0,b.InRegion,b.IsP);
+                });
+                size_t genLive=genBegin;
+                while (genLive<genEnd && RayHeads[genLive].RemainingLegs!=0) ++genLive;
+
+                // Group legs of this generation for the multi-ray kernel.
+                // (legs with the same region, wave type and depth range; cached legs are traced alone)
+                vector<vector<size_t>> groups;
+                if (Batch.RayBundle>1) {
+                    map<tuple<int,bool,double,double>,size_t> open;
+                    for (size_t k=genBegin;k<genLive;++k) {
+                        double Top,Bot;
+                        findLegDepths(RayHeads[k],specialDepths,RegionBounds,Top,Bot);
+                        if (Batch.UseLegCache && RayHeads[k].InRegion==0 && Cache.find(RayHeads[k].IsP,RayHeads[k].RayP,Top,Bot)) {
+                            groups.push_back({k});
+                            continue;
+                        }
+                        auto key=make_tuple(RayHeads[k].InRegion,RayHeads[k].IsP,Top,Bot);
+                        auto it=open.find(key);
+                        if (it==open.end() || groups[it->second].size()==min(Batch.RayBundle,(size_t)_RAYBUNDLE)) {
+                            open[key]=groups.size();
+                            groups.push_back({k});
+                        }
+                        else groups[it->second].push_back(k);
+                    }
+                }
+                else for (size_t k=genBegin;k<genLive;++k) groups.push_back({k});
+
+                atomic<size_t> next(0);
+                vector<thread> allThreads;
+                for (size_t t=0;t<Batch.nThread;++t)
+                    allThreads.push_back(thread([&](){
+                        for (size_t k=next.fetch_add(1);k<groups.size();k=next.fetch_add(1)) traceBundle(groups[k],genEnd);
+                    }));
+                for (auto &t: allThreads) t.join();
+
+                // Beam pruning of the next generation.
+                size_t childN=finalSize.load()-genEnd;
+                double discarded=0,total=0;
+                if (BeamWidth>0 && childN>BeamWidth) {
+                    vector<size_t> children(childN);
+                    iota(children.begin(),children.end(),genEnd);
+                    nth_element(children.begin(),children.begin()+BeamWidth,children.end(),[&RayHeads](const size_t &a, const size_t &b){
+                        return fabs(RayHeads[a].Amp)>fabs(RayHeads[b].Amp);
+                    });
+                    for (size_t k=BeamWidth;k<childN;++k) {
+                        discarded+=fabs(RayHeads[children[k]].Amp);
+                        RayHeads[children[k]].RemainingLegs=0;
+                    }
+                }
+                for (size_t k=genEnd;k<genEnd+childN;++k) total+=fabs(RayHeads[k].Amp);
+                if (childN>0) Out.BeamDiscarded.push_back({discarded,total});
 
-            double Tdist=theta2-theta1,Rdist=radius2-radius1;
+                // Rays in a finished generation can't be merge targets anymore.
+                Merger.clear();
 
-            size_t NPTS=2;
-            double dL=_RE,dR=Rdist,dT=Tdist;
-            while (dL>RectifyLimit){
-                NPTS*=2;
-                dR=Rdist/(NPTS-1);
-                dT=Tdist/(NPTS-1);
-                dL=LocDist(theta1,0,radius1,theta1+dT,0,radius1+dR);
+                genBegin=genEnd;
+                genEnd=finalSize.load();
             }
+            return;
+        }
 
-            // Add rectified segments to this polygon.
-            for (size_t k=0;k+1<NPTS;++k)
-                tmpRegion.push_back(make_pair(theta1+k*dT,radius1+k*dR));
+        // Thread slots, guarded by "mtx".
+        mutex mtx;
+        condition_variable cv;
+        queue<size_t> emptySlot;
+        vector<thread> allThreads(Batch.nThread);
+        for (size_t i=0; i<Batch.nThread; ++i) {
+            emptySlot.push(i);
         }
 
-        // Add this rectified polygon to region array.
-        Regions.push_back(tmpRegion);
+        size_t Index = 0;
+
+        while (true) {
+
+            unique_lock<mutex> lck(mtx);
+
+            cv.wait(lck, [&emptySlot](){ return !emptySlot.empty(); }); // if emptySlot is empty, release the lock and wait for signal.
+
+            // emptySlot is not empty, holding the lock.
+
+            if (Index < finalSize.load()) { // if there's more job to do, do the next job.
+
+                size_t mySlot=emptySlot.front();
+
+                if (allThreads[mySlot].joinable()) {
+
+                    allThreads[mySlot].join();
+                }
+
+                // Rays before "Index" are no longer merge targets: "addRay" reads "Index" under "Merger.Mtx",
+                // so advance it under the same lock before the leg starts running.
+                size_t k=Index;
+                {
+                    lock_guard<mutex> mergeLck(Merger.Mtx);
+                    ++Index;
+                }
+
+                allThreads[mySlot] = thread([&traceLeg,&Index,&mtx,&cv,&emptySlot](size_t k, size_t mySlot){
+
+                    traceLeg(k,Index,nullptr);
+
+                    unique_lock<mutex> lck(mtx);
+                    emptySlot.push(mySlot);
+                    cv.notify_one();
+
+                }, k, mySlot);
+
+                emptySlot.pop();
+            }
+            else { // there's no more work to do.
+
+                if (emptySlot.size() == Batch.nThread) { // if there's no running thread left, join threads and exit.
+
+                    for (auto &t : allThreads) {
 
-        RegionN[i]=(int)tmpRegion.size();
-        RegionsTheta[i]=(double *)malloc(tmpRegion.size()*sizeof(double));
-        RegionsRadius[i]=(double *)malloc(tmpRegion.size()*sizeof(double));
-        for (int j=0;j<RegionN[i];++j){
-            RegionsTheta[i][j]=tmpRegion[j].first;
-            RegionsRadius[i][j]=tmpRegion[j].second;
+                        if (t.joinable()) {
+
+                            t.join();
+                        }
+                    }
+                    return;
+                }
+                else { // if there's running jobs, release the lock and wait for thread finished signal.
+
+                    cv.wait(lck);
+                }
+            }
         }
+    };
 
+    if (Batch.TwoPass<=1) {
+        runTree(R,Vp,Vs,Rho,nullptr,Batch.BeamWidth);
+        return Out;
     }
 
-    // adjust bounds to the values in R[0].
-    for (size_t i=0;i<regionPolygonsTheta.size();++i){
-        RegionBounds[i+1][2]=R[0][adjustedYmin[i+1]];
-        RegionBounds[i+1][3]=R[0][adjustedYmax[i+1]];
+    // Pass one.
+    runTree(Rc,Vpc,Vsc,Rhoc,nullptr,Batch.BeamWidth);
+
+    set<string> Survivors;
+    auto addPrefixes=[&Survivors](const string &branch){
+        for (size_t k=branch.find(':')+1;k<=branch.size();++k) Survivors.insert(branch.substr(0,k));
+    };
+    for (size_t i=0;i<potentialSize;++i) {
+        if (Out.ReachSurfaces[i].empty()) continue;
+        for (int I=(int)i;I!=-1;I=RayHeads[I].Prev) {
+            addPrefixes(RayHeads[I].Branch);
+            for (const auto &item:RayHeads[I].MergedBranch) addPrefixes(item);
+        }
     }
 
-    // derive layers for this polygon.
-    for (size_t i=0;i<regionPolygonsTheta.size();++i)
-        R.push_back(vector<double> (R[0].begin()+adjustedYmax[i+1],R[0].begin()+adjustedYmin[i+1]+1));
+    // Clear the outputs of pass one. (beam pruning was done in pass one, keep its report)
+    vector<pair<double,double>> BeamDiscarded;
+    swap(BeamDiscarded,Out.BeamDiscarded);
+    Out=TraceResult(potentialSize);
 
-    // properties for these polygon.
-    vector<double> dVp{1},dVs{1},dRho{1}; // Region 0 has dVp=1 ,...
-    for (size_t i=0;i<regionPolygonsTheta.size();++i) {
-        dVp.push_back(1.0+regionProperties[i][0]/100);
-        dVs.push_back(1.0+regionProperties[i][1]/100);
-        dRho.push_back(1.0+regionProperties[i][2]/100);
+    // Pass two.
+    runTree(R,Vp,Vs,Rho,&Survivors,0);
+    swap(BeamDiscarded,Out.BeamDiscarded);
+
+    return Out;
+}
+
+const TraceResult &Tracer::trace(const TraceBatch &Batch, TraceHistory &History) const {
+
+    if (Batch.BeamWidth>0) throw runtime_error("Incremental tracing error: beam search is not supported ...");
+
+    int branches=(Batch.TS+Batch.TD+Batch.RS+Batch.RD);
+    size_t N=Batch.initRaySteps.size(),potentialSize=PotentialSize(Batch.initRaySteps,branches);
+
+    const auto &Prev=History.Batch;
+    bool sameOptions=(!History.Slots.empty() && Batch.options()==Prev.options() &&
+                      Batch.RayNumberOffset==Prev.RayNumberOffset && LayerKey==History.LayerKey);
+
+    // Model edits: the old and new bounds of the regions that changed (polygon or properties).
+    vector<vector<double>> changedBounds;
+    for (size_t k=1;k<max(Regions.size(),History.Regions.size());++k) {
+        if (k<Regions.size() && k<History.Regions.size() && Regions[k]==History.Regions[k] &&
+            RegionBounds[k]==History.RegionBounds[k] &&
+            make_tuple(dVp[k],dVs[k],dRho[k])==make_tuple(History.dVp[k],History.dVs[k],History.dRho[k])) continue;
+        if (k<Regions.size()) changedBounds.push_back(RegionBounds[k]);
+        if (k<History.Regions.size()) changedBounds.push_back(History.RegionBounds[k]);
     }
 
-    // derive properties layers for all regions (include 1D reference).
-    vector<vector<double>> Vp(R.size(),vector<double> ()),Vs=Vp,Rho=Vp;
-    for (size_t i=0;i<R.size();++i) {
-        for (const auto &item:R[i]) {
-            auto ans=MakeRef(_RE-item,Deviation);
-            Vp[i].push_back(dVp[i]*ans[0]);
-            Vs[i].push_back(dVs[i]*ans[1]);
-            Rho[i].push_back(dRho[i]*ans[2]);
+    // Does any leg of this input ray come near the changed regions?
+    // (a leg depends on other regions only through the points on its path: where it starts and where it enters them)
+    auto &Out=History.Out;
+    auto touched=[&](const vector<size_t> &slots){
+        if (changedBounds.empty()) return false;
+        for (const auto &j:slots) {
+            if (Out.RaysTheta[j].empty()) continue;
+            auto t=minmax_element(Out.RaysTheta[j].begin(),Out.RaysTheta[j].end());
+            auto r=minmax_element(Out.RaysRadius[j].begin(),Out.RaysRadius[j].end());
+            for (const auto &b:changedBounds)
+                if (*t.first<=b[1] && b[0]<=*t.second && *r.first<=b[3] && b[2]<=*r.second) return true;
+        }
+        return false;
+    };
+
+    // Input rays to trace again: changed lines, new lines, or near a model edit.
+    vector<size_t> changed;
+    vector<bool> keep(N,false);
+    bool full=!sameOptions;
+    for (size_t i=0;i<N && !full;++i) {
+        if (i<History.Slots.size() &&
+            make_tuple(Batch.initRaySteps[i],Batch.initRayComp[i],Batch.initRayColor[i],
+                       Batch.initRayTheta[i],Batch.initRayDepth[i],Batch.initRayTakeoff[i])==
+            make_tuple(Prev.initRaySteps[i],Prev.initRayComp[i],Prev.initRayColor[i],
+                       Prev.initRayTheta[i],Prev.initRayDepth[i],Prev.initRayTakeoff[i]) &&
+            !touched(History.Slots[i])) {
+            keep[i]=true;
+            // (fewer steps in total: kept legs must stay within the outputs)
+            for (const auto &j:History.Slots[i]) full|=(j>=potentialSize);
         }
+        else changed.push_back(i);
     }
 
-    // Create initial rays.
-    for (size_t i=0;i<initRaySteps.size();++i){
+    // Trace everything again when most input rays changed (one parallel batch is faster), or when merged rays
+    // tie the results of different input rays together.
+    full|=(2*changed.size()>N || (Batch.MergeRays && !changed.empty()));
+
+    if (full) {
+        Out=(N==0?TraceResult():trace(Batch));
 
-        // Source in any polygons?
-        size_t rid=0;
-        for (size_t i=1;i<Regions.size();++i)
-            if (PointInPolygon(Regions[i],make_pair(initRayTheta[i],_RE-initRayDepth[i]),1,RegionBounds[i])) {rid=i;break;}
+        // Input ray of each leg. (initial rays take the first N positions, a leg comes after its parent)
+        History.Slots.assign(N,{});
+        vector<size_t> owner(potentialSize);
+        for (size_t j=0;j<potentialSize;++j) {
+            if (Out.RayInfo[j].empty()) continue;
+            owner[j]=(j<N?j:owner[Out.PathHeaders[j].Parent]);
+            History.Slots[owner[j]].push_back(j);
+        }
+    }
+    else {
+
+        // Trace the changed input rays alone.
+        TraceBatch single(Batch);
+        vector<TraceResult> Results(changed.size());
+        for (size_t k=0;k<changed.size();++k) {
+            size_t i=changed[k];
+            single.initRaySteps={Batch.initRaySteps[i]};
+            single.initRayComp={Batch.initRayComp[i]};
+            single.initRayColor={Batch.initRayColor[i]};
+            single.initRayTheta={Batch.initRayTheta[i]};
+            single.initRayDepth={Batch.initRayDepth[i]};
+            single.initRayTakeoff={Batch.initRayTakeoff[i]};
+            Results[k]=trace(single);
+        }
 
-        // Calculate ray parameter.
-        auto ans=MakeRef(initRayDepth[i],Deviation);
-        double v=(initRayComp[i]==0?ans[0]*dVp[rid]:ans[1]*dVs[rid]);
-        double rayp=M_PI/180*(_RE-initRayDepth[i])*sin(fabs(initRayTakeoff[i])/180*M_PI)/v;
+        // Free the legs of the changed and removed input rays.
+        auto clearSlot=[&Out](const size_t &j){
+            Out.ReachSurfaces[j].clear();
+            Out.RayInfo[j].clear();
+            vector<double>().swap(Out.RaysTheta[j]);
+            vector<double>().swap(Out.RaysRadius[j]);
+            Out.ArrivalLegs[j].clear();
+            Out.ArrivalBranch[j].clear();
+            Out.Arrivals[j]=SurfaceArrival();
+            Out.PathHeaders[j]=PathHeader();
+        };
+        for (const auto &i:changed)
+            if (i<History.Slots.size()) for (const auto &j:History.Slots[i]) clearSlot(j);
+        for (size_t i=N;i<History.Slots.size();++i)
+            for (const auto &j:History.Slots[i]) clearSlot(j);
+        History.Slots.resize(N);
+
+        Out.ReachSurfaces.resize(potentialSize);
+        Out.RayInfo.resize(potentialSize);
+        Out.RaysTheta.resize(potentialSize);
+        Out.RaysRadius.resize(potentialSize);
+        Out.ArrivalLegs.resize(potentialSize);
+        Out.ArrivalBranch.resize(potentialSize);
+        Out.Arrivals.resize(potentialSize);
+        Out.PathHeaders.resize(potentialSize);
+
+        // New positions: a changed input ray takes its previous positions first, then the free ones.
+        // (each input ray uses at most its "PotentialSize" positions, so the free ones are enough)
+        vector<bool> used(potentialSize,false);
+        for (size_t i=0;i<N;++i)
+            if (keep[i]) for (const auto &j:History.Slots[i]) used[j]=true;
+
+        vector<vector<size_t>> Slots(changed.size());
+        for (size_t k=0;k<changed.size();++k) {
+            size_t need=0,i=changed[k];
+            for (const auto &item:Results[k].RayInfo) need+=!item.empty();
+            if (i<History.Slots.size())
+                for (const auto &j:History.Slots[i]) {
+                    if (Slots[k].size()==need) break;
+                    if (j<potentialSize) {Slots[k].push_back(j);used[j]=true;}
+                }
+        }
+        size_t next=0;
+        for (size_t k=0;k<changed.size();++k) {
+            size_t need=0;
+            for (const auto &item:Results[k].RayInfo) need+=!item.empty();
+            while (Slots[k].size()<need) {
+                while (used[next]) ++next;
+                Slots[k].push_back(next);
+                used[next]=true;
+            }
+        }
 
-        // Push this ray into "RayHeads" for future processing.
-        RayHeads.push_back(Ray(initRayComp[i]==0,fabs(initRayTakeoff[i])>=90,initRayTakeoff[i]<0,
-                    (initRayComp[i]==0?"P":(initRayComp[i]==1?"SV":"SH")),
-                    (int)rid,initRaySteps[i],initRayColor[i],
-                    initRayTheta[i],_RE-initRayDepth[i],0,0,rayp,initRayTakeoff[i]));
+        // Splice into the outputs.
+        for (size_t k=0;k<changed.size();++k) {
+            size_t i=changed[k];
+            auto &item=Results[k];
+            vector<int> slot(item.RayInfo.size(),-1);
+            for (size_t j=0,l=0;j<item.RayInfo.size();++j)
+                if (!item.RayInfo[j].empty()) slot[j]=(int)Slots[k][l++];
+
+            for (size_t j=0;j<item.RayInfo.size();++j) {
+                if (slot[j]==-1) continue;
+                size_t J=slot[j];
+                // (<RayTrain> is the last field, numbered by the new positions)
+                if (!item.ReachSurfaces[j].empty()) {
+                    string train;
+                    for (int I=(int)j;I!=-1;I=item.PathHeaders[I].Parent)
+                        train=to_string(1+Batch.RayNumberOffset+slot[I])+(train.empty()?"":"->")+train;
+                    auto &line=item.ReachSurfaces[j];
+                    line=line.substr(0,line.rfind(' ')+1)+train;
+                }
+                Out.ReachSurfaces[J]=move(item.ReachSurfaces[j]);
+                Out.RayInfo[J]=move(item.RayInfo[j]);
+                Out.RaysTheta[J]=move(item.RaysTheta[j]);
+                Out.RaysRadius[J]=move(item.RaysRadius[j]);
+                Out.ArrivalLegs[J]=move(item.ArrivalLegs[j]);
+                // (each input ray was traced as a one-ray batch: its branch codes start with "0:")
+                const auto &branch=item.ArrivalBranch[j];
+                Out.ArrivalBranch[J]=(branch.empty()?branch:to_string(i)+branch.substr(branch.find(':')));
+                Out.Arrivals[J]=move(item.Arrivals[j]);
+                Out.PathHeaders[J]=item.PathHeaders[j];
+                if (item.PathHeaders[j].Parent!=-1) Out.PathHeaders[J].Parent=slot[item.PathHeaders[j].Parent];
+            }
+            History.Slots[i]=move(Slots[k]);
+        }
     }
 
-    atomic<size_t> finalSize;
-    finalSize.store(RayHeads.size());
-    RayHeads.resize(potentialSize);
+    History.Batch=Batch;
+    History.LayerKey=LayerKey;
+    History.Regions=Regions;
+    History.RegionBounds=RegionBounds;
+    History.dVp=dVp;
+    History.dVs=dVs;
+    History.dRho=dRho;
+    return Out;
+}
 
-    // Start ray tracing. (Finally!)
-    //
-    // Process each "Ray" leg in "RayHeads".
-    // For future legs generated by reflction/refraction, create new "Ray" and assign it to the proper position in "RayHeads" vector.
-    vector<thread> allThreads(nThread);
-    for (size_t i=0; i<nThread; ++i) {
-        emptySlot.push(i);
+vector<double> Tracer::perturb(const TraceResult &Out, const vector<vector<double>> &regionProperties,
+                               const double &Threshold, vector<bool> &Refresh) const {
+
+    if (regionProperties.size()+1!=Regions.size())
+        throw runtime_error("Travel-time perturbation error: number of regions doesn't match ...");
+
+    vector<double> newdVp{1},newdVs{1};
+    for (const auto &item:regionProperties) {
+        newdVp.push_back(1.0+item[0]/100);
+        newdVs.push_back(1.0+item[1]/100);
     }
 
-    size_t Index = 0;
+    vector<double> ans(Out.ArrivalLegs.size(),0);
+    Refresh.assign(Out.ArrivalLegs.size(),false);
+    for (size_t i=0;i<Out.ArrivalLegs.size();++i) {
+        // (summed from the last leg, as the travel time in "ReachSurfaces")
+        for (auto it=Out.ArrivalLegs[i].rbegin();it!=Out.ArrivalLegs[i].rend();++it) {
+            const auto &leg=*it;
+            double dv=(leg.IsP?dVp:dVs)[leg.Region],newdv=(leg.IsP?newdVp:newdVs)[leg.Region];
+            ans[i]+=leg.TravelTime*dv/newdv;
+            if (fabs(newdv/dv-1)>Threshold) Refresh[i]=true;
+        }
+    }
+    return ans;
+}
 
-    while (true) {
+vector<vector<pair<double,string>>> Tracer::solve(const TraceBatch &Batch, const vector<TwoPointTarget> &Targets,
+                                                  const size_t &nScan, const double &Tolerance) const {
+
+    if (nScan<2) throw runtime_error("Two-point tracing error: need at least 2 takeoff samples ...");
+    if (Tolerance<=0) throw runtime_error("Two-point tracing error: tolerance<=0 ...");
+
+    vector<vector<pair<double,string>>> ans(Targets.size());
+
+    auto solveTarget=[&](const TwoPointTarget &T, vector<pair<double,string>> &Lines){
+
+        // Trace one takeoff, find the arrival of the phase: misfit (deg) and its receiver line.
+        TraceBatch B=Batch;
+        B.nThread=1;
+        B.initRaySteps={T.Steps};
+        B.initRayComp={T.Comp};
+        B.initRayColor={0};
+        B.initRayTheta={T.Theta};
+        B.initRayDepth={T.Depth};
+        auto evaluate=[&](const double &takeoff, double &misfit, string &line){
+            B.initRayTakeoff={takeoff};
+            auto Out=traceModel(B,Regions,RegionBounds,dVp,dVs,dRho);
+            for (size_t i=0;i<Out.ReachSurfaces.size();++i) {
+                if (Out.ReachSurfaces[i].empty() || Out.Arrivals[i].Phase!=T.Phase) continue;
+                misfit=Lon2180(Out.Arrivals[i].Dist-T.Theta)-T.Distance;
+                line=Out.ReachSurfaces[i];
+                return true;
+            }
+            return false;
+        };
+
+        // Scan.
+        vector<double> takeoff(nScan),misfit(nScan);
+        vector<string> line(nScan);
+        vector<bool> found(nScan);
+        for (size_t i=0;i<nScan;++i) {
+            takeoff[i]=T.Takeoff1+(T.Takeoff2-T.Takeoff1)*i/(nScan-1);
+            found[i]=evaluate(takeoff[i],misfit[i],line[i]);
+            if (found[i] && fabs(misfit[i])<=Tolerance) Lines.push_back({misfit[i],line[i]});
+        }
 
-        unique_lock<mutex> lck(mtx);
+        // Refine each bracket. If it doesn't converge (the phase disappears inside, or distance jumps across the target
+        // between grid points), its closest arrival is given instead.
+        for (size_t i=0;i+1<nScan;++i) {
+            if (!found[i] || !found[i+1] || fabs(misfit[i])<=Tolerance || fabs(misfit[i+1])<=Tolerance) continue;
+            if ((misfit[i]<0)==(misfit[i+1]<0)) continue;
+
+            double a=takeoff[i],b=takeoff[i+1],fa=misfit[i],fb=misfit[i+1],width=fabs(b-a),c,fc;
+            bool bisect=false;
+            string l;
+            pair<double,string> best=(fabs(fa)<fabs(fb)?make_pair(fa,line[i]):make_pair(fb,line[i+1]));
+            for (size_t j=0;j<_TWOPOINTITER;++j) {
+                c=(bisect?(a+b)/2:b-fb*(b-a)/(fb-fa));
+                if (!(c>min(a,b) && c<max(a,b))) c=(a+b)/2;
+                if (!evaluate(c,fc,l)) break;
+                if (fabs(fc)<fabs(best.first)) best={fc,l};
+                if (fabs(fc)<=Tolerance) break;
+                if ((fc<0)==(fa<0)) {a=c;fa=fc;}
+                else {b=c;fb=fc;}
+                bisect=(fabs(b-a)>width/2);
+                width=fabs(b-a);
+            }
+            Lines.push_back(best);
+        }
 
-        cv.wait(lck, [](){ return !emptySlot.empty(); }); // if emptySlot is empty, release the lock and wait for signal.
+        // Sort by takeoff.
+        auto takeoffOf=[](const pair<double,string> &s){return stod(s.second.substr(0,s.second.find(' ')));};
+        stable_sort(Lines.begin(),Lines.end(),[&](const pair<double,string> &x,const pair<double,string> &y){
+            return takeoffOf(x)<takeoffOf(y);
+        });
+    };
 
-        // emptySlot is not empty, holding the lock.
+    atomic<size_t> next(0);
+    vector<thread> allThreads;
+    for (size_t t=0;t<max((size_t)1,Batch.nThread);++t)
+        allThreads.push_back(thread([&](){
+            for (size_t k=next.fetch_add(1);k<Targets.size();k=next.fetch_add(1))
+                solveTarget(Targets[k],ans[k]);
+        }));
+    for (auto &t: allThreads) t.join();
 
-        if (Index < finalSize.load()) { // if there's more job to do, do the next job.
+    return ans;
+}
 
-            if (allThreads[emptySlot.front()].joinable()) {
+vector<double> Tracer::fan(const TraceBatch &Batch, const TakeoffFan &Fan, const double &Tolerance, const double &MinStep) const {
+
+    if (Fan.Step<=0) throw runtime_error("Adaptive fan error: step<=0 ...");
+    if (Tolerance<=0) throw runtime_error("Adaptive fan error: tolerance<=0 ...");
+    if (MinStep<=0) throw runtime_error("Adaptive fan error: minimum step<=0 ...");
+
+    // Arrivals of one ray: "<WaveTypeTrain> <regions of each leg>" --> surfacing distances (sorted).
+    using Signature=map<string,vector<double>>;
+    auto signature=[&](const double &takeoff){
+        TraceBatch B=Batch;
+        B.nThread=1;
+        B.initRaySteps={Fan.Steps};
+        B.initRayComp={Fan.Comp};
+        B.initRayColor={Fan.Color};
+        B.initRayTheta={Fan.Theta};
+        B.initRayDepth={Fan.Depth};
+        B.initRayTakeoff={takeoff};
+        auto Out=traceModel(B,Regions,RegionBounds,dVp,dVs,dRho);
+
+        Signature ans;
+        for (size_t i=0;i<Out.ReachSurfaces.size();++i) {
+            if (Out.ReachSurfaces[i].empty()) continue;
+            string key=Out.Arrivals[i].Phase;
+            for (const auto &leg: Out.ArrivalLegs[i]) key+=" "+to_string(leg.Region);
+            ans[key].push_back(Lon2180(Out.Arrivals[i].Dist-Fan.Theta));
+        }
+        for (auto &item: ans) sort(item.second.begin(),item.second.end());
+        return ans;
+    };
 
-                allThreads[emptySlot.front()].join();
-            }
+    auto differ=[&Tolerance](const Signature &a, const Signature &b){
+        if (a.size()!=b.size()) return true;
+        for (auto it1=a.begin(),it2=b.begin();it1!=a.end();++it1,++it2) {
+            if (it1->first!=it2->first || it1->second.size()!=it2->second.size()) return true;
+            for (size_t i=0;i<it1->second.size();++i)
+                if (fabs(Lon2180(it1->second[i]-it2->second[i]))>Tolerance) return true;
+        }
+        return false;
+    };
 
-            allThreads[emptySlot.front()] = thread(followThisRay, Index, emptySlot.front(), ref(finalSize),
-                ReachSurfaces, ReachSurfacesSize, RayInfo, RayInfoSize, RaysTheta, RaysN, RaysRadius,
-                ref(RayHeads), branches, cref(specialDepths),
-                cref(R), cref(Vp), cref(Vs), cref(Rho),
-                cref(Regions), cref(RegionBounds), cref(dVp), cref(dVs), cref(dRho),
-                cref(DebugInfo), cref(TS), cref(TD), cref(RS), cref(RD), cref(StopAtSurface));
+    // Initial fan.
+    map<double,Signature> Rays;
+    vector<double> todo;
+    size_t n=max((size_t)1,(size_t)ceil(fabs(Fan.Takeoff2-Fan.Takeoff1)/Fan.Step));
+    for (size_t i=0;i<=n;++i) todo.push_back(Fan.Takeoff1+(Fan.Takeoff2-Fan.Takeoff1)*i/n);
+
+    // Trace the new rays, then split the intervals that differ.
+    while (!todo.empty()) {
+        vector<Signature> S(todo.size());
+        atomic<size_t> next(0);
+        vector<thread> allThreads;
+        for (size_t t=0;t<max((size_t)1,Batch.nThread);++t)
+            allThreads.push_back(thread([&](){
+                for (size_t k=next.fetch_add(1);k<todo.size();k=next.fetch_add(1))
+                    S[k]=signature(todo[k]);
+            }));
+        for (auto &t: allThreads) t.join();
+
+        set<double> added(todo.begin(),todo.end());
+        for (size_t k=0;k<todo.size();++k) Rays[todo[k]]=move(S[k]);
+        todo.clear();
+
+        // (only intervals next to a new ray can change)
+        for (auto it=Rays.begin(),it2=std::next(Rays.begin());it2!=Rays.end();++it,++it2) {
+            if (!added.count(it->first) && !added.count(it2->first)) continue;
+            if (it2->first-it->first>MinStep && differ(it->second,it2->second))
+                todo.push_back((it->first+it2->first)/2);
+        }
+    }
 
-            emptySlot.pop();
+    vector<double> ans;
+    for (const auto &item: Rays) ans.push_back(item.first);
+    return ans;
+}
 
-            ++Index;
+vector<vector<double>> Tracer::eikonal(const double &Theta, const double &Depth, const bool &IsP,
+                                       const double &ThetaInc, const double &RadiusInc) const {
+
+    if (ThetaInc<=0 || RadiusInc<=0) throw runtime_error("Eikonal error: grid increment<=0 ...");
+
+    size_t nTheta=(size_t)round(360/ThetaInc),nRadius=(size_t)ceil(_RE/RadiusInc-1e-6);
+    double dTheta=360.0/nTheta;
+    auto radius=[&](const size_t &j){return _RE-RadiusInc*j;};
+
+    // Slowness of each node. (0 velocity --> infinity)
+    const auto &V=(IsP?Vp:Vs);
+    const auto &dV=(IsP?dVp:dVs);
+    double inf=numeric_limits<double>::infinity();
+    vector<vector<double>> S(nRadius,vector<double>(nTheta));
+    for (size_t j=0;j<nRadius;++j) {
+        double v=V[findClosetLayer(R,radius(j))];
+        for (size_t i=0;i<nTheta;++i) {
+            size_t rid=0;
+            for (size_t k=1;k<Regions.size();++k)
+                if (PointInPolygon(Regions[k],make_pair(i*dTheta,radius(j)),1,RegionBounds[k])) {rid=k;break;}
+            double a=(rid==0?AnomalyScale(Anomalies,(IsP?0:1),i*dTheta,radius(j)):1);
+            S[j][i]=(v*dV[rid]*a>0?1/(v*dV[rid]*a):inf);
         }
-        else { // there's no more work to do.
+    }
 
-            if (emptySlot.size() == nThread) { // if there's no running thread left, join threads and exit.
+    // Fast marching: nodes are accepted in order of travel time.
+    vector<vector<double>> T(nRadius,vector<double>(nTheta,inf));
+    vector<vector<bool>> Known(nRadius,vector<bool>(nTheta,false));
+    priority_queue<pair<double,size_t>,vector<pair<double,size_t>>,greater<pair<double,size_t>>> Trial;
+
+    // Around the source, straight-line times.
+    double sr=_RE-Depth,st=Lon2360(Theta);
+    size_t j0=min(nRadius-1,(size_t)round(Depth/RadiusInc)),i0=(size_t)round(st/dTheta)%nTheta;
+    double s0=S[j0][i0];
+    if (std::isinf(s0)) throw runtime_error("Eikonal error: zero velocity at the source ...");
+    for (int dj=-2;dj<=2;++dj)
+        for (int di=-2;di<=2;++di) {
+            if ((int)j0+dj<0 || (int)j0+dj>=(int)nRadius) continue;
+            size_t j=j0+dj,i=(i0+nTheta+di)%nTheta;
+            if (std::isinf(S[j][i])) continue;
+            double r=radius(j),dt=(i*dTheta-st)*M_PI/180;
+            T[j][i]=sqrt(r*r+sr*sr-2*r*sr*cos(dt))*(s0+S[j][i])/2;
+            Trial.push(make_pair(T[j][i],j*nTheta+i));
+        }
 
-                for (auto &t : allThreads) {
+    // First-order upwind update of node (j,i) from its accepted neighbours.
+    auto update=[&](const size_t &j, const size_t &i){
+        double a=min(Known[j][(i+1)%nTheta]?T[j][(i+1)%nTheta]:inf,Known[j][(i+nTheta-1)%nTheta]?T[j][(i+nTheta-1)%nTheta]:inf);
+        double b=min(j>0 && Known[j-1][i]?T[j-1][i]:inf,j+1<nRadius && Known[j+1][i]?T[j+1][i]:inf);
+        double h1=radius(j)*dTheta*M_PI/180,h2=RadiusInc,s=S[j][i];
+        double ans=min(a+s*h1,b+s*h2);
+        if (!std::isinf(a) && !std::isinf(b)) {
+            // (t-a)^2/h1^2 + (t-b)^2/h2^2 = s^2
+            double A=1/(h1*h1)+1/(h2*h2),B=-2*(a/(h1*h1)+b/(h2*h2)),C=a*a/(h1*h1)+b*b/(h2*h2)-s*s,D=B*B-4*A*C;
+            if (D>=0) {
+                double t=(-B+sqrt(D))/(2*A);
+                if (t>=max(a,b)) ans=min(ans,t);
+            }
+        }
+        if (ans<T[j][i]) {
+            T[j][i]=ans;
+            Trial.push(make_pair(ans,j*nTheta+i));
+        }
+    };
 
-                    if (t.joinable()) {
+    while (!Trial.empty()) {
+        size_t j=Trial.top().second/nTheta,i=Trial.top().second%nTheta;
+        Trial.pop();
+        if (Known[j][i]) continue;
+        Known[j][i]=true;
 
-                        t.join();
-                    }
+        for (const auto &item: {make_pair(j,(i+1)%nTheta),make_pair(j,(i+nTheta-1)%nTheta),
+                                make_pair(j-1,i),make_pair(j+1,i)}) {
+            if (item.first>=nRadius || Known[item.first][item.second] || std::isinf(S[item.first][item.second])) continue;
+            update(item.first,item.second);
+        }
+    }
+    return T;
+}
+
+// Surface arrivals in "Out", grouped by lineage: "<WaveTypeTrain> <branch code>" (the branch code without the input ray index,
+// so arrivals of different input rays following the same branches share a lineage).
+// Each arrival: {takeoff, distance (deg from "sourceTheta", positive towards increasing theta), travel time, rayp, incident
+// angle, amplitude}, sorted by takeoff.
+void CollectArrivals(const TraceResult &Out, const double &sourceTheta, map<string,vector<vector<double>>> &Lineages){
+    for (size_t i=0;i<Out.ReachSurfaces.size();++i) {
+        if (Out.ReachSurfaces[i].empty()) continue;
+        const auto &A=Out.Arrivals[i];
+        const auto &branch=Out.ArrivalBranch[i];
+        Lineages[A.Phase+" "+branch.substr(branch.find(':')+1)].push_back(
+            {A.Takeoff,Lon2180(A.Dist-sourceTheta),A.TravelTime,A.RayP,A.Inc,A.Amp});
+    }
+    for (auto &item: Lineages) stable_sort(item.second.begin(),item.second.end());
+}
+
+// Split arrivals of one lineage (sorted by takeoff, fields as in "CollectArrivals") into branches where the distance is
+// monotone. A triplication gives three branches; neighbouring branches share their turning arrival.
+// Arrivals are not connected if they are more than "MaxGap" (deg of takeoff, 0 means no limit) apart (e.g. across a shadow
+// zone), or if their travel-time difference doesn't fit their rayp: on a branch, |dT| lies between min and max rayp times |dX|
+// (10% slack), otherwise the ray jumped to another part of the model in between.
+vector<vector<vector<double>>> MonotoneBranches(const vector<vector<double>> &Arrivals, const double &MaxGap){
+
+    auto connected=[&MaxGap](const vector<double> &a, const vector<double> &b){
+        if (MaxGap>0 && b[0]-a[0]>MaxGap) return false;
+        double dx=fabs(b[1]-a[1]),dt=fabs(b[2]-a[2]);
+        return (dt>=0.9*min(a[3],b[3])*dx-1e-3 && dt<=1.1*max(a[3],b[3])*dx+1e-3);
+    };
+
+    vector<vector<vector<double>>> ans;
+    int direction=0;
+    for (size_t i=0;i<Arrivals.size();++i) {
+        if (i==0 || !connected(ans.back().back(),Arrivals[i])) {
+            ans.push_back({Arrivals[i]});
+            direction=0;
+            continue;
+        }
+        double d=Arrivals[i][1]-ans.back().back()[1];
+        if (d==0) continue;
+        int now=(d>0?1:-1);
+        if (direction!=0 && now!=direction) ans.push_back({ans.back().back()});
+        direction=now;
+        ans.back().push_back(Arrivals[i]);
+    }
+    // single arrivals can't be interpolated.
+    ans.erase(remove_if(ans.begin(),ans.end(),[](const vector<vector<double>> &b){return b.size()<2;}),ans.end());
+    return ans;
+}
+
+// Interpolate a monotone branch at distance "dist". Travel time uses a cubic Hermite with slopes from the rayp (dT/dX),
+// the other fields are linear. Returns false if "dist" is outside the branch.
+bool InterpolateBranch(const vector<vector<double>> &Branch, const double &dist, vector<double> &Values){
+    if (Branch.size()<2) return false;
+    bool increasing=(Branch.back()[1]>Branch[0][1]);
+    auto it=lower_bound(Branch.begin(),Branch.end(),dist,[&increasing](const vector<double> &a,const double &x){
+        return (increasing?a[1]<x:a[1]>x);
+    });
+    if (it==Branch.end()) return false;
+    if (it==Branch.begin()) {
+        if ((*it)[1]!=dist) return false;
+        ++it;
+    }
+    const auto &a=*(it-1),&b=*it;
+    double h=b[1]-a[1],s=(dist-a[1])/h;
+    Values.resize(a.size());
+    for (size_t j=0;j<a.size();++j) Values[j]=a[j]+(b[j]-a[j])*s;
+
+    // Hermite: the sign of dT/dX follows the secant.
+    double sign=(b[2]-a[2])*h<0?-1:1,m1=sign*a[3]*h,m2=sign*b[3]*h;
+    Values[2]=(2*s*s*s-3*s*s+1)*a[2]+(s*s*s-2*s*s+s)*m1+(-2*s*s*s+3*s*s)*b[2]+(s*s*s-s*s)*m2;
+    return true;
+}
+
+void Tracer::tabulate(const TraceBatch &Batch, const vector<int> &Comps, const vector<int> &Steps,
+                      const double &Takeoff1, const double &Takeoff2, const double &TakeoffInc, TravelTimeTable &Table) const {
+
+    if (TakeoffInc<=0) throw runtime_error("Travel-time table error: takeoff increment<=0 ...");
+    if (Comps.size()!=Table.Phases.size() || Steps.size()!=Table.Phases.size())
+        throw runtime_error("Travel-time table error: number of phases doesn't match ...");
+
+    Table.Data.assign(Table.Phases.size()*Table.nDepth*Table.nDist*3,numeric_limits<float>::quiet_NaN());
+    size_t nTakeoff=(size_t)floor(fabs(Takeoff2-Takeoff1)/TakeoffInc+1e-6)+1;
+    double inc=(Takeoff2>=Takeoff1?TakeoffInc:-TakeoffInc);
+
+    auto job=[&](const size_t &phase, const size_t &depth){
+
+        // Trace the fan.
+        TraceBatch B=Batch;
+        B.nThread=1;
+        B.initRaySteps.assign(nTakeoff,Steps[phase]);
+        B.initRayComp.assign(nTakeoff,Comps[phase]);
+        B.initRayColor.assign(nTakeoff,0);
+        B.initRayTheta.assign(nTakeoff,Table.Theta);
+        B.initRayDepth.assign(nTakeoff,Table.Depth1+Table.DepthInc*depth);
+        B.initRayTakeoff.clear();
+        for (size_t i=0;i<nTakeoff;++i) B.initRayTakeoff.push_back(Lon2180(Takeoff1+inc*i));
+        auto Out=traceModel(B,Regions,RegionBounds,dVp,dVs,dRho);
+
+        map<string,vector<vector<double>>> Lineages;
+        CollectArrivals(Out,Table.Theta,Lineages);
+
+        // Interpolate onto the distance grid, keep the earliest arrival.
+        vector<double> values;
+        for (const auto &item: Lineages) {
+            if (item.first.substr(0,item.first.find(' '))!=Table.Phases[phase]) continue;
+            for (const auto &branch: MonotoneBranches(item.second,1.5*TakeoffInc)) {
+                for (size_t k=0;k<Table.nDist;++k) {
+                    if (!InterpolateBranch(branch,Table.Dist1+Table.DistInc*k,values)) continue;
+                    float *p=Table.at(phase,depth,k);
+                    if (!std::isnan(p[0]) && p[0]<=values[2]) continue;
+                    p[0]=values[2];
+                    p[1]=values[3];
+                    p[2]=values[4];
                 }
-                return;
             }
-            else { // if there's running jobs, release the lock and wait for thread finished signal.
+        }
+    };
+
+    atomic<size_t> next(0);
+    vector<thread> allThreads;
+    for (size_t t=0;t<max((size_t)1,Batch.nThread);++t)
+        allThreads.push_back(thread([&](){
+            for (size_t k=next.fetch_add(1);k<Table.Phases.size()*Table.nDepth;k=next.fetch_add(1))
+                job(k/Table.nDepth,k%Table.nDepth);
+        }));
+    for (auto &t: allThreads) t.join();
+}
+
+// Receiver gather: arrivals in "Out" (traced from "Batch") interpolated at station distances (deg from the source, positive
+// towards increasing theta). Input rays with the same source (theta, depth, component) form a fan; arrivals of each source and
+// lineage (see "CollectArrivals") are split into monotone branches, only connecting arrivals from neighbouring rays of the fan.
+// Every branch covering a station gives one arrival (see "GatherArrival"), sorted by station, source and travel time.
+vector<GatherArrival> ReceiverGather(const TraceBatch &Batch, const TraceResult &Out, const vector<double> &Stations){
+
+    // Sources, and the position of each input ray in its fan (sorted by takeoff).
+    map<tuple<double,double,int>,vector<double>> Fans;
+    vector<size_t> sourceIndex(Batch.initRaySteps.size());
+    for (size_t i=0;i<Batch.initRaySteps.size();++i)
+        Fans[make_tuple(Batch.initRayTheta[i],Batch.initRayDepth[i],Batch.initRayComp[i])].push_back(Batch.initRayTakeoff[i]);
+    for (auto &item: Fans) {
+        sort(item.second.begin(),item.second.end());
+        item.second.erase(unique(item.second.begin(),item.second.end()),item.second.end());
+    }
+    for (size_t i=0;i<Batch.initRaySteps.size();++i)
+        sourceIndex[i]=distance(Fans.begin(),Fans.find(make_tuple(Batch.initRayTheta[i],Batch.initRayDepth[i],Batch.initRayComp[i])));
+    vector<const vector<double> *> fanTakeoffs;
+    for (const auto &item: Fans) fanTakeoffs.push_back(&item.second);
+
+    // Arrivals of each (source, lineage). The takeoff field is replaced by the position in the fan, so only neighbouring rays
+    // are connected (a gap of 1).
+    map<pair<size_t,string>,vector<vector<double>>> Lineages;
+    for (size_t i=0;i<Out.ReachSurfaces.size();++i) {
+        if (Out.ReachSurfaces[i].empty()) continue;
+        const auto &A=Out.Arrivals[i];
+
+        const auto &branch=Out.ArrivalBranch[i];
+        size_t input=stoul(branch.substr(0,branch.find(':'))),source=sourceIndex[input];
+        const auto &T=*fanTakeoffs[source];
+        double position=lower_bound(T.begin(),T.end(),Batch.initRayTakeoff[input])-T.begin();
+        Lineages[make_pair(source,A.Phase+" "+branch.substr(branch.find(':')+1))].push_back(
+            {position,Lon2180(A.Dist-Batch.initRayTheta[input]),A.TravelTime,A.RayP,A.Inc,A.Amp});
+    }
 
-                cv.wait(lck);
+    // Interpolate.
+    vector<tuple<size_t,size_t,double,double,string>> order; // station, source, travel time, takeoff, phase. (for sorting)
+    vector<GatherArrival> arrivals;
+    vector<double> values;
+    for (auto &item: Lineages) {
+        size_t source=item.first.first;
+        const auto &T=*fanTakeoffs[source];
+        const auto &key=*next(Fans.begin(),source);
+        string phase=item.first.second.substr(0,item.first.second.find(' '));
+        sort(item.second.begin(),item.second.end());
+
+        for (const auto &branch: MonotoneBranches(item.second,1.5)) {
+            for (size_t k=0;k<Stations.size();++k) {
+                if (!InterpolateBranch(branch,Stations[k],values)) continue;
+                size_t j=min((size_t)values[0],T.size()-1);
+                double takeoff=(j+1<T.size()?T[j]+(T[j+1]-T[j])*(values[0]-j):T[j]);
+                order.push_back(make_tuple(k,source,values[2],takeoff,phase));
+                arrivals.push_back({k,get<0>(key.first),get<1>(key.first),{takeoff,values[3],values[4],Stations[k],values[2],values[5],phase}});
             }
         }
     }
+
+    vector<size_t> index(arrivals.size());
+    iota(index.begin(),index.end(),0);
+    sort(index.begin(),index.end(),[&](const size_t &a, const size_t &b){return order[a]<order[b];});
+
+    vector<GatherArrival> ans;
+    for (const auto &i: index) ans.push_back(move(arrivals[i]));
+    return ans;
+}
+
+const uint64_t TravelTimeTableMagic=0x454c424154594152ULL; // "RAYTABLE"
+const uint64_t TravelTimeTableVersion=1;
+const size_t TravelTimeTablePhaseLength=32;
+
+// Write a travel-time table. (written to a temporary file first, then renamed)
+void SaveTravelTimeTable(const string &file, const TravelTimeTable &Table){
+
+    vector<uint64_t> header{TravelTimeTableMagic,TravelTimeTableVersion,Table.Phases.size(),Table.nDepth,Table.nDist,3};
+    vector<double> axes{Table.Theta,Table.Depth1,Table.DepthInc,Table.Dist1,Table.DistInc};
+    string names(Table.Phases.size()*TravelTimeTablePhaseLength,'\0');
+    for (size_t i=0;i<Table.Phases.size();++i) {
+        if (Table.Phases[i].size()>=TravelTimeTablePhaseLength)
+            throw runtime_error("Travel-time table error: phase name too long: "+Table.Phases[i]+" ...");
+        names.replace(i*TravelTimeTablePhaseLength,Table.Phases[i].size(),Table.Phases[i]);
+    }
+
+    string tmpFile=file+".tmp"+to_string(getpid());
+    ofstream fpout(tmpFile,ios::binary);
+    fpout.write((const char *)header.data(),header.size()*sizeof(uint64_t));
+    fpout.write((const char *)axes.data(),axes.size()*sizeof(double));
+    fpout.write(names.data(),names.size());
+    fpout.write((const char *)Table.Data.data(),Table.Data.size()*sizeof(float));
+    fpout.close();
+
+    if (!fpout || rename(tmpFile.c_str(),file.c_str())!=0) {
+        remove(tmpFile.c_str());
+        throw runtime_error("Travel-time table error: can't write "+file+" ...");
+    }
+}
+
+// Read a travel-time table. Returns false if the file isn't a valid table.
+bool LoadTravelTimeTable(const string &file, TravelTimeTable &Table){
+
+    int fd=open(file.c_str(),O_RDONLY);
+    if (fd<0) return false;
+    struct stat st;
+    size_t headerSize=6*sizeof(uint64_t)+5*sizeof(double);
+    if (fstat(fd,&st)!=0 || (size_t)st.st_size<headerSize) {
+        close(fd);
+        return false;
+    }
+    size_t fileSize=st.st_size;
+    void *addr=mmap(nullptr,fileSize,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (addr==MAP_FAILED) return false;
+
+    const uint64_t *header=(const uint64_t *)addr;
+    uint64_t nPhase=header[2],nDepth=header[3],nDist=header[4];
+    bool ok=(header[0]==TravelTimeTableMagic && header[1]==TravelTimeTableVersion && header[5]==3 &&
+             fileSize==headerSize+nPhase*TravelTimeTablePhaseLength+nPhase*nDepth*nDist*3*sizeof(float));
+
+    if (ok) {
+        const double *axes=(const double *)(header+6);
+        Table.Theta=axes[0];
+        Table.Depth1=axes[1];
+        Table.DepthInc=axes[2];
+        Table.Dist1=axes[3];
+        Table.DistInc=axes[4];
+        Table.nDepth=nDepth;
+        Table.nDist=nDist;
+        const char *names=(const char *)(axes+5);
+        Table.Phases.clear();
+        for (size_t i=0;i<nPhase;++i) Table.Phases.push_back(string(names+i*TravelTimeTablePhaseLength));
+        const float *p=(const float *)(names+nPhase*TravelTimeTablePhaseLength);
+        Table.Data.assign(p,p+nPhase*nDepth*nDist*3);
+    }
+
+    munmap(addr,fileSize);
+    return ok;
+}
+
+TextWriter::TextWriter(const string &file, const int &precision) : Precision(precision), FileName(file) {
+    File=fopen(file.c_str(),"w");
+    if (File==nullptr) throw runtime_error("Output error: can't open "+file+" ...");
+}
+
+TextWriter::~TextWriter(){
+    if (File!=nullptr) {
+        write();
+        fclose(File);
+    }
+}
+
+TextWriter &TextWriter::operator<<(const double &x){
+    char s[64];
+    auto res=(Precision==0?to_chars(s,s+sizeof(s),x,Format):to_chars(s,s+sizeof(s),x,Format,Precision));
+    Buffer.append(s,res.ptr);
+    return spill();
+}
+
+void TextWriter::write(){
+    if (!Buffer.empty() && fwrite(Buffer.data(),1,Buffer.size(),File)!=Buffer.size()) Failed=true;
+    Buffer.clear();
+}
+
+void TextWriter::close(){
+    if (File==nullptr) return;
+    write();
+    if (fclose(File)!=0) Failed=true;
+    File=nullptr;
+    if (Failed) throw runtime_error("Output error: can't write "+FileName+" ...");
+}
+
+const uint64_t RayPathsMagic=0x5348544150594152ULL; // "RAYPATHS"
+const uint64_t RayPathsVersion=1;
+
+// Write all ray paths to one binary file. (written to a temporary file first, then renamed)
+void SaveRayPaths(const string &file, const TraceResult &Out){
+
+    struct Record {
+        int64_t Id,Parent,Color,Type;
+        double TravelTime,Amp;
+        uint64_t Offset,Count;
+    };
+
+    vector<Record> legs;
+    uint64_t nPoint=0;
+    for (size_t i=0;i<Out.RayInfo.size();++i) {
+        if (Out.RayInfo[i].empty()) continue;
+        const auto &H=Out.PathHeaders[i];
+        legs.push_back({(int64_t)i+1,(int64_t)H.Parent+1,H.Color,H.Type,H.TravelTime,H.Amp,nPoint,Out.RaysTheta[i].size()});
+        nPoint+=Out.RaysTheta[i].size();
+    }
+    vector<uint64_t> header{RayPathsMagic,RayPathsVersion,legs.size(),nPoint};
+
+    string tmpFile=file+".tmp"+to_string(getpid());
+    ofstream fpout(tmpFile,ios::binary);
+    fpout.write((const char *)header.data(),header.size()*sizeof(uint64_t));
+    fpout.write((const char *)legs.data(),legs.size()*sizeof(Record));
+    for (const auto &item: legs)
+        fpout.write((const char *)Out.RaysTheta[item.Id-1].data(),item.Count*sizeof(double));
+    for (const auto &item: legs)
+        fpout.write((const char *)Out.RaysRadius[item.Id-1].data(),item.Count*sizeof(double));
+    fpout.close();
+
+    if (!fpout || rename(tmpFile.c_str(),file.c_str())!=0) {
+        remove(tmpFile.c_str());
+        throw runtime_error("Ray path error: can't write "+file+" ...");
+    }
+}
+
+// Copy a model and its tracing results to the C-style arrays used by "PreprocessAndRun" and "rayTracingInSwift".
+void CopyResults(const Tracer &tracer, const TraceResult &Out,
+        char **ReachSurfaces, int *ReachSurfacesSize, char **RayInfo, int *RayInfoSize,
+        int *RegionN,double **RegionsTheta,double **RegionsRadius,
+        double **RaysTheta, int *RaysN, double **RaysRadius) {
+
+    const auto &Regions=tracer.regions();
+    for (size_t i=1;i<Regions.size();++i){
+        RegionN[i-1]=(int)Regions[i].size();
+        RegionsTheta[i-1]=(double *)malloc(Regions[i].size()*sizeof(double));
+        RegionsRadius[i-1]=(double *)malloc(Regions[i].size()*sizeof(double));
+        for (int j=0;j<RegionN[i-1];++j){
+            RegionsTheta[i-1][j]=Regions[i][j].first;
+            RegionsRadius[i-1][j]=Regions[i][j].second;
+        }
+    }
+
+    auto copyString=[](const string &str, char **dest, int *destSize){
+        if (str.empty()) return;
+        *destSize=(int)str.size()+1;
+        *dest=(char *)malloc((str.size()+1)*sizeof(char));
+        strcpy(*dest,str.c_str());
+    };
+
+    for (size_t i=0;i<Out.RayInfo.size();++i) {
+        copyString(Out.ReachSurfaces[i],ReachSurfaces+i,ReachSurfacesSize+i);
+        copyString(Out.RayInfo[i],RayInfo+i,RayInfoSize+i);
+        if (Out.RaysTheta[i].empty()) continue;
+        RaysN[i]=(int)Out.RaysTheta[i].size();
+        RaysTheta[i]=(double *)malloc(RaysN[i]*sizeof(double));
+        RaysRadius[i]=(double *)malloc(RaysN[i]*sizeof(double));
+        copy(Out.RaysTheta[i].begin(),Out.RaysTheta[i].end(),RaysTheta[i]);
+        copy(Out.RaysRadius[i].begin(),Out.RaysRadius[i].end(),RaysRadius[i]);
+    }
+}
+
+void PreprocessAndRun (
+
+        const vector<int> &initRaySteps,const vector<int> &initRayComp,const vector<int> &initRayColor,
+        const vector<double> &initRayTheta,const vector<double> &initRayDepth,const vector<double> &initRayTakeoff,
+        const vector<double> &gridDepth1,const vector<double> &gridDepth2,const vector<double> &gridInc,
+        const vector<double> &specialDepths,const vector<vector<double>> &Deviation,
+        const vector<vector<double>> &regionProperties,
+        const vector<vector<double>> &regionPolygonsTheta,
+        const vector<vector<double>> &regionPolygonsDepth,
+
+        const double &RectifyLimit, const bool &TS, const bool &TD, const bool &RS, const bool &RD,
+        const size_t &nThread, const bool &DebugInfo, const bool &StopAtSurface,
+        const bool &UseLegCache, const double &LegCacheRaypInc,
+        const bool &MergeRays, const double &MergeTolerance,
+        const bool &Wavefront, const size_t &BeamWidth, vector<pair<double,double>> &BeamDiscarded, const size_t &RayBundle,
+        const int &LayerIntegrator, const double &AdaptiveGridMargin, const double &AdaptiveGridInc,
+        const size_t &TwoPass, const string &ModelCachePrefix,
+        const size_t &branches, const size_t &potentialSize,
+
+        char **ReachSurfaces, int *ReachSurfacesSize, char **RayInfo, int *RayInfoSize,
+        int *RegionN,double **RegionsTheta,double **RegionsRadius,
+        double **RaysTheta, int *RaysN, double **RaysRadius,int *Observer) {
+
+    if (initRaySteps.empty()) {
+        return;
+    }
+
+    Tracer tracer(gridDepth1,gridDepth2,gridInc,specialDepths,Deviation,regionProperties,regionPolygonsTheta,regionPolygonsDepth,
+                  RectifyLimit,AdaptiveGridMargin,AdaptiveGridInc,initRayDepth,nThread,ModelCachePrefix);
+
+    TraceBatch Batch;
+    Batch.initRaySteps=initRaySteps;
+    Batch.initRayComp=initRayComp;
+    Batch.initRayColor=initRayColor;
+    Batch.initRayTheta=initRayTheta;
+    Batch.initRayDepth=initRayDepth;
+    Batch.initRayTakeoff=initRayTakeoff;
+    Batch.TS=TS;Batch.TD=TD;Batch.RS=RS;Batch.RD=RD;
+    Batch.nThread=nThread;
+    Batch.DebugInfo=DebugInfo;
+    Batch.StopAtSurface=StopAtSurface;
+    Batch.UseLegCache=UseLegCache;
+    Batch.LegCacheRaypInc=LegCacheRaypInc;
+    Batch.MergeRays=MergeRays;
+    Batch.MergeTolerance=MergeTolerance;
+    Batch.Wavefront=Wavefront;
+    Batch.BeamWidth=BeamWidth;
+    Batch.RayBundle=RayBundle;
+    Batch.LayerIntegrator=LayerIntegrator;
+    Batch.TwoPass=TwoPass;
+    auto Out=tracer.trace(Batch);
+
+    BeamDiscarded=Out.BeamDiscarded;
+    CopyResults(tracer,Out,ReachSurfaces,ReachSurfacesSize,RayInfo,RayInfoSize,RegionN,RegionsTheta,RegionsRadius,
+                RaysTheta,RaysN,RaysRadius);
     return;
 }
 
@@ -986,12 +3013,9 @@ void rayTracingInSwift(
 
     double RectifyLimit=inputRectifyLimit;
     bool TS=inputTS,TD=inputTD,RS=inputRS,RD=inputRD,DebugInfo=false,StopAtSurface=inputStopAtSurface;
-    size_t nThread=(size_t)inputNThread,potentialSize=0;
+    size_t nThread=(size_t)inputNThread;
     int branches=TS+TD+RS+RD;
-    for (size_t i=0;i<initRaySteps.size();++i){
-        if (branches<=1) potentialSize+=initRaySteps[i];
-        else potentialSize+=(1-pow(branches,initRaySteps[i]))/(1-branches);
-    }
+    size_t potentialSize=PotentialSize(initRaySteps,branches);
 
     // Spaces for the outputs.
     Observer=(int *)malloc(1*sizeof(int));
@@ -1015,11 +3039,41 @@ void rayTracingInSwift(
     RegionN=(int *)malloc(regionProperties.size()*sizeof(int));
     for (size_t i=0;i<regionProperties.size();++i) RegionN[i]=0;
 
+    // The preprocessed model is kept between calls, and only rebuilt when the model inputs change.
+    // The ray trees of the previous call are kept too, also across rebuilds (e.g. a polygon edit): "trace" compares
+    // the 1D layers and regions with the history, and only input rays that changed or come near an edit are traced again.
+    // Their legs take free ray numbers (array positions), so after the first call the numbers of an input ray's legs
+    // are not in tracing order. Follow a ray train by <RayTrain>, not by array positions.
+    static mutex tracerMtx;
+    static unique_ptr<const Tracer> tracer;
+    static uint64_t tracerKey=0;
+    static TraceHistory history;
+
+    uint64_t key=0;
+    ModelCacheFile("",initRayDepth,gridDepth1,gridDepth2,gridInc,specialDepths,Deviation,
+                   regionProperties,regionPolygonsTheta,regionPolygonsDepth,RectifyLimit,0,0,key);
+
+    lock_guard<mutex> lck(tracerMtx);
+    if (!tracer || key!=tracerKey) {
+        tracer.reset(new Tracer(gridDepth1,gridDepth2,gridInc,specialDepths,Deviation,
+                                regionProperties,regionPolygonsTheta,regionPolygonsDepth,RectifyLimit));
+        tracerKey=key;
+    }
+
     // Call the C++ code.
-    PreprocessAndRun(
-        initRaySteps,initRayComp,initRayColor,
-        initRayTheta,initRayDepth,initRayTakeoff,gridDepth1,gridDepth2,gridInc,specialDepths,
-        Deviation,regionProperties,regionPolygonsTheta,regionPolygonsDepth,
-        RectifyLimit,TS,TD,RS,RD,nThread,DebugInfo,StopAtSurface,(size_t)branches,potentialSize,
-        *ReachSurfaces,ReachSurfacesSize,*RayInfo,RayInfoSize,RegionN,RegionsTheta,RegionsRadius,RaysTheta,RaysN,RaysRadius,Observer);
+    TraceBatch Batch;
+    Batch.initRaySteps=initRaySteps;
+    Batch.initRayComp=initRayComp;
+    Batch.initRayColor=initRayColor;
+    Batch.initRayTheta=initRayTheta;
+    Batch.initRayDepth=initRayDepth;
+    Batch.initRayTakeoff=initRayTakeoff;
+    Batch.TS=TS;Batch.TD=TD;Batch.RS=RS;Batch.RD=RD;
+    Batch.nThread=nThread;
+    Batch.DebugInfo=DebugInfo;
+    Batch.StopAtSurface=StopAtSurface;
+    const auto &Out=tracer->trace(Batch,history);
+
+    CopyResults(*tracer,Out,*ReachSurfaces,ReachSurfacesSize,*RayInfo,RayInfoSize,RegionN,RegionsTheta,RegionsRadius,
+                RaysTheta,RaysN,RaysRadius);
 }
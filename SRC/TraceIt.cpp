@@ -7,12 +7,39 @@ using namespace std;
 // The main function mostly dealt with I/O.
 int main(int argc, char **argv){
 
-    enum PI{DebugInfo,TS,TD,RS,RD,StopAtSurface,nThread,FLAG1};
-    enum PS{InputRays,Layers,Depths,Ref,Polygons,ReceiverFileName,PolygonFilePrefix,RayFilePrefix,FLAG2};
-    enum PF{RectifyLimit,FLAG3};
+    enum PI{DebugInfo,TS,TD,RS,RD,StopAtSurface,nThread,UseLegCache,MergeRays,Wavefront,BeamWidth,RayBundle,LayerIntegrator,TwoPass,TwoPointScan,OutputPrecision,FLAG1};
+    enum PS{InputRays,Layers,Depths,Ref,Polygons,ReceiverFileName,PolygonFilePrefix,RayFilePrefix,ModelCachePrefix,Scenarios,TwoPoint,TwoPointFileName,Fans,TablePhases,TableFileName,Stations,GatherFileName,EikonalSources,EikonalFilePrefix,SmoothAnomalies,RayFileFormat,FLAG2};
+    enum PF{RectifyLimit,LegCacheRaypInc,MergeTolerance,AdaptiveGridMargin,AdaptiveGridInc,PerturbThreshold,TwoPointTolerance,FanTolerance,FanMinStep,
+            TableTheta,TableDepth1,TableDepth2,TableDepthInc,TableTakeoff1,TableTakeoff2,TableTakeoffInc,TableDist1,TableDist2,TableDistInc,
+            EikonalThetaInc,EikonalRadiusInc,FLAG3};
 
     auto P=ReadParameters<PI,PS,PF> (argc,argv,cin,FLAG1,FLAG2,FLAG3);
 
+    // check.
+    if (P[MergeRays]!=0 && P[MergeTolerance]<=0) throw runtime_error("Merge tolerance error: tolerance<=0 ...");
+    if (P[BeamWidth]<0) throw runtime_error("Beam width error: width<0 ...");
+    if (P[RayBundle]<0 || P[RayBundle]>_RAYBUNDLE)
+        throw runtime_error("Ray bundle size error: should be 0 ~ "+to_string(_RAYBUNDLE)+" ...");
+    if (P[LayerIntegrator]<0 || P[LayerIntegrator]>2) throw runtime_error("Layer integrator error: should be 0, 1 or 2 ...");
+    if (P[AdaptiveGridMargin]>0 && P[AdaptiveGridInc]<=0) throw runtime_error("Adaptive grid error: increment<=0 ...");
+    if (P[TwoPass]<0) throw runtime_error("Two-pass coarsening factor error: factor<0 ...");
+    if (P[PerturbThreshold]<0) throw runtime_error("Perturbation threshold error: threshold<0 ...");
+    if (P[OutputPrecision]<0 || P[OutputPrecision]>17) throw runtime_error("Output precision error: should be 0 ~ 17 ...");
+    if (P[TwoPointScan]<2) throw runtime_error("Two-point scan error: samples<2 ...");
+    if (P[TwoPointTolerance]<=0) throw runtime_error("Two-point tolerance error: tolerance<=0 ...");
+    if (P[FanTolerance]<=0) throw runtime_error("Adaptive fan tolerance error: tolerance<=0 ...");
+    if (P[FanMinStep]<=0) throw runtime_error("Adaptive fan step error: minimum step<=0 ...");
+    if (P[TableFileName]!="NONE") {
+        if (P[TableDepth1]<0 || P[TableDepth2]>6371 || P[TableDepth2]<P[TableDepth1] || P[TableDepthInc]<=0)
+            throw runtime_error("Travel-time table depth error ...");
+        if (P[TableDist2]<P[TableDist1] || P[TableDistInc]<=0) throw runtime_error("Travel-time table distance error ...");
+        if (P[TableTakeoffInc]<=0) throw runtime_error("Travel-time table takeoff error: increment<=0 ...");
+    }
+    if (P[RayFileFormat]!="text" && P[RayFileFormat]!="binary" && P[RayFileFormat]!="gmt")
+        throw runtime_error("Ray file format error: should be text, binary or gmt ...");
+    if (P[EikonalFilePrefix]!="NONE" && (P[EikonalThetaInc]<=0 || P[EikonalRadiusInc]<=0))
+        throw runtime_error("Eikonal grid error: increment<=0 ...");
+
     // Read in source settings.
     ifstream fpin;
     int steps,color;
@@ -39,8 +66,37 @@ int main(int argc, char **argv){
         initRayColor.push_back(color);
     }
     fpin.close();
+
+
+    // Read in adaptive takeoff fans.
+    vector<TakeoffFan> fans;
+    double takeoff1,takeoff2,step;
+    fpin.open(P[Fans]);
+    while (fpin >> theta >> depth >> takeoff1 >> takeoff2 >> comp >> color >> steps >> step){
+        // check.
+        if (depth<0 || depth>6371)
+            throw runtime_error("Fan source depth error @ line " + to_string(fans.size()+1) + "...");
+        if (comp!="P" && comp!="SV" && comp!="SH")
+            throw runtime_error("Fan source component error @ line " + to_string(fans.size()+1) + "...");
+        if (steps<=0)
+            throw runtime_error("Fan source step error: step<=0 @ line " + to_string(fans.size()+1) + "...");
+        if (step<=0)
+            throw runtime_error("Fan takeoff step error: step<=0 @ line " + to_string(fans.size()+1) + "...");
+
+        TakeoffFan F;
+        F.Theta=Lon2360(theta);
+        F.Depth=depth;
+        F.Takeoff1=Lon2180(takeoff1);
+        F.Takeoff2=Lon2180(takeoff2);
+        F.Comp=(comp=="P"?0:(comp=="SV"?1:2));
+        F.Color=color;
+        F.Steps=steps;
+        F.Step=step;
+        fans.push_back(F);
+    }
+    fpin.close();
     // check.
-    if (initRaySteps.empty()) throw runtime_error("No valid source, input format error?");
+    if (initRaySteps.empty() && fans.empty()) throw runtime_error("No valid source, input format error?");
 
 
     // Read in grid setting.
@@ -141,6 +197,162 @@ int main(int argc, char **argv){
     fpin.close();
 
 
+    // Read in smooth anomalies (2D Gaussian velocity perturbations in the 1D reference region).
+    vector<SmoothAnomaly> anomalies;
+    double thetaWidth,depthWidth;
+    fpin.open(P[SmoothAnomalies]);
+    while (fpin >> theta >> depth >> thetaWidth >> depthWidth >> dvp >> dvs >> drho){
+        // check.
+        if (depth<0 || depth>6371)
+            throw runtime_error("Smooth anomaly depth error @ line "+ to_string(anomalies.size()+1) +" ...");
+        if (thetaWidth<=0 || depthWidth<=0)
+            throw runtime_error("Smooth anomaly width error: width<=0 @ line "+ to_string(anomalies.size()+1) +" ...");
+        if (dvp<=-100 || dvs<=-100 || drho<=-100)
+            throw runtime_error("Smooth anomaly property error @ line "+ to_string(anomalies.size()+1) +" ...");
+
+        anomalies.push_back({Lon2360(theta),depth,thetaWidth,depthWidth,dvp,dvs,drho});
+    }
+    fpin.close();
+    // check.
+    if (!anomalies.empty() && P[LayerIntegrator]!=2)
+        throw runtime_error("Smooth anomaly error: only traced by the adaptive-step integrator (LayerIntegrator=2) ...");
+
+
+    // Read in scenarios (variants of one polygon).
+    struct Scenario {
+        string Name;
+        bool Reshaped;
+        size_t Region;
+        vector<double> Properties,PolygonTheta,PolygonDepth;
+    };
+    vector<Scenario> scenarios;
+    double heightScale,widthScale;
+    fpin.open(P[Scenarios]);
+    while (getline(fpin,tmpstr)){
+        if (tmpstr.empty()) continue;
+        stringstream ss(tmpstr);
+        Scenario S;
+        int region;
+        if (!(ss >> S.Name >> region >> dvp >> dvs >> drho >> heightScale >> widthScale))
+            throw runtime_error("Scenario input format error @ line "+ to_string(scenarios.size()+1) +" ...");
+        // check.
+        if (region<1 || region>(int)regionProperties.size())
+            throw runtime_error("Scenario region error @ line "+ to_string(scenarios.size()+1) +" ...");
+        if (dvp<-100 || dvs<-100 || drho<-100)
+            throw runtime_error("Scenario property error @ line "+ to_string(scenarios.size()+1) +" ...");
+        if (heightScale<=0 || widthScale<=0)
+            throw runtime_error("Scenario scale error: scale<=0 @ line "+ to_string(scenarios.size()+1) +" ...");
+
+        // Scale the polygon: height about its bottom, width about its center.
+        S.Reshaped=(heightScale!=1 || widthScale!=1);
+        S.Region=region;
+        S.Properties={dvp,dvs,drho};
+        const auto &theta0=regionPolygonsTheta[region-1],&depth0=regionPolygonsDepth[region-1];
+        auto t=minmax_element(theta0.begin(),theta0.end());
+        double center=(*t.first+*t.second)/2,bottom=*max_element(depth0.begin(),depth0.end());
+        for (size_t i=0;i<theta0.size();++i) {
+            S.PolygonTheta.push_back(center+(theta0[i]-center)*widthScale);
+            S.PolygonDepth.push_back(bottom-(bottom-depth0[i])*heightScale);
+            if (S.PolygonDepth.back()<0)
+                throw runtime_error("Scenario scale error: polygon above the surface @ line "+ to_string(scenarios.size()+1) +" ...");
+        }
+        scenarios.push_back(S);
+    }
+    fpin.close();
+
+
+    // Read in two-point targets (receiver distances to solve takeoff angles for).
+    vector<TwoPointTarget> targets;
+    double distance;
+    fpin.open(P[TwoPoint]);
+    while (getline(fpin,tmpstr)){
+        if (tmpstr.empty()) continue;
+        stringstream ss(tmpstr);
+        TwoPointTarget T;
+        if (!(ss >> T.Name >> theta >> depth >> comp >> steps >> T.Phase >> distance >> takeoff1 >> takeoff2))
+            throw runtime_error("Two-point input format error @ line "+ to_string(targets.size()+1) +" ...");
+        // check.
+        if (depth<0 || depth>6371)
+            throw runtime_error("Two-point source depth error @ line "+ to_string(targets.size()+1) +" ...");
+        if (comp!="P" && comp!="SV" && comp!="SH")
+            throw runtime_error("Two-point source component error @ line "+ to_string(targets.size()+1) +" ...");
+        if (steps<=0)
+            throw runtime_error("Two-point source step error: step<=0 @ line "+ to_string(targets.size()+1) +" ...");
+
+        T.Theta=Lon2360(theta);
+        T.Depth=depth;
+        T.Comp=(comp=="P"?0:(comp=="SV"?1:2));
+        T.Steps=steps;
+        T.Distance=Lon2180(distance);
+        T.Takeoff1=Lon2180(takeoff1);
+        T.Takeoff2=Lon2180(takeoff2);
+        targets.push_back(T);
+    }
+    fpin.close();
+
+
+    // Read in travel-time table phases.
+    TravelTimeTable table;
+    vector<int> tableComps,tableSteps;
+    if (P[TableFileName]!="NONE") {
+        string phase;
+        fpin.open(P[TablePhases]);
+        while (fpin >> phase >> comp >> steps){
+            // check.
+            if (comp!="P" && comp!="SV" && comp!="SH")
+                throw runtime_error("Travel-time table component error @ line "+ to_string(table.Phases.size()+1) +" ...");
+            if (steps<=0)
+                throw runtime_error("Travel-time table step error: step<=0 @ line "+ to_string(table.Phases.size()+1) +" ...");
+
+            table.Phases.push_back(phase);
+            tableComps.push_back(comp=="P"?0:(comp=="SV"?1:2));
+            tableSteps.push_back(steps);
+        }
+        fpin.close();
+
+        table.Theta=Lon2360(P[TableTheta]);
+        table.Depth1=P[TableDepth1];
+        table.DepthInc=P[TableDepthInc];
+        table.nDepth=(size_t)floor((P[TableDepth2]-P[TableDepth1])/P[TableDepthInc]+1e-6)+1;
+        table.Dist1=P[TableDist1];
+        table.DistInc=P[TableDistInc];
+        table.nDist=(size_t)floor((P[TableDist2]-P[TableDist1])/P[TableDistInc]+1e-6)+1;
+    }
+
+
+    // Read in station distances (receiver gather).
+    vector<string> stationNames;
+    vector<double> stationDists;
+    fpin.open(P[Stations]);
+    while (fpin >> tmpstr >> distance){
+        stationNames.push_back(tmpstr);
+        stationDists.push_back(Lon2180(distance));
+    }
+    fpin.close();
+
+
+    // Read in eikonal sources.
+    struct EikonalSource {
+        string Name;
+        double Theta,Depth;
+        bool IsP;
+    };
+    vector<EikonalSource> eikonalSources;
+    if (P[EikonalFilePrefix]!="NONE") {
+        fpin.open(P[EikonalSources]);
+        while (fpin >> tmpstr >> theta >> depth >> comp){
+            // check.
+            if (depth<0 || depth>=6371)
+                throw runtime_error("Eikonal source depth error @ line "+ to_string(eikonalSources.size()+1) +" ...");
+            if (comp!="P" && comp!="SV" && comp!="SH")
+                throw runtime_error("Eikonal source component error @ line "+ to_string(eikonalSources.size()+1) +" ...");
+
+            eikonalSources.push_back({tmpstr,Lon2360(theta),depth,comp=="P"});
+        }
+        fpin.close();
+    }
+
+
     // I/O is Done.
     //
     // Currently we have these variables ------ :
@@ -148,68 +360,145 @@ int main(int argc, char **argv){
     // vector<int> initRaySteps,initRayComp,initRayColor;
     // vector<double> initRayTheta,initRayDepth,initRayTakeoff,gridDepth1,gridDepth2,gridInc,specialDepths;
     // vector<vector<double>> Deviation,regionProperties,regionPolygonsTheta,regionPolygonsDepth;
+    // vector<SmoothAnomaly> anomalies;
+    // vector<TakeoffFan> fans;
+    // vector<Scenario> scenarios;
+    // vector<TwoPointTarget> targets;
+    // TravelTimeTable table;
+    // vector<string> stationNames;
+    // vector<double> stationDists;
+    // vector<EikonalSource> eikonalSources;
     //
     // For future I/O modification, you can start from begining and stop here.
 
 
-    // Estimate the output size and malloc spaces.
-    size_t potentialSize=0;
-    int branches=(P[TS]+P[TD]+P[RS]+P[RD]);
-    for (size_t i=0;i<initRaySteps.size();++i){
-        if (branches<=1) potentialSize+=initRaySteps[i];
-        else potentialSize+=(1-pow(branches,initRaySteps[i]))/(1-branches);
-    }
-
-    int *Observer=(int *)malloc(1*sizeof(int));
-    *Observer=-1;
-
-    double **RegionsTheta=(double **)malloc(regionProperties.size()*sizeof(double *));
-    double **RegionsRadius=(double **)malloc(regionProperties.size()*sizeof(double *));
-    double **RaysTheta=(double **)malloc(potentialSize*sizeof(double *));
-    double **RaysRadius=(double **)malloc(potentialSize*sizeof(double *));
-    char **ReachSurfaces=(char **)malloc(potentialSize*sizeof(char *));
-    char **RayInfo=(char **)malloc(potentialSize*sizeof(char *));
-
-    int *RaysN=(int *)malloc(potentialSize*sizeof(int));
-    int *ReachSurfacesSize=(int *)malloc(potentialSize*sizeof(int));
-    int *RayInfoSize=(int *)malloc(potentialSize*sizeof(int));
-    for (int i=0;i<(int)potentialSize;++i) {
-        RaysN[i]=0;
-        ReachSurfacesSize[i]=0;
-        RayInfoSize[i]=0;
+    // Preprocess the model and trace the input rays.
+    auto sourceDepths=initRayDepth;
+    for (const auto &F: fans) sourceDepths.push_back(F.Depth);
+    for (const auto &T: targets) sourceDepths.push_back(T.Depth);
+    for (size_t i=0;i<table.nDepth && !table.Phases.empty();++i) sourceDepths.push_back(table.Depth1+table.DepthInc*i);
+    Tracer tracer(gridDepth1,gridDepth2,gridInc,specialDepths,Deviation,regionProperties,regionPolygonsTheta,regionPolygonsDepth,
+                  P[RectifyLimit],P[AdaptiveGridMargin],P[AdaptiveGridInc],sourceDepths,(size_t)P[nThread],P[ModelCachePrefix],
+                  anomalies);
+
+    TraceBatch Batch;
+    Batch.initRaySteps=initRaySteps;
+    Batch.initRayComp=initRayComp;
+    Batch.initRayColor=initRayColor;
+    Batch.initRayTheta=initRayTheta;
+    Batch.initRayDepth=initRayDepth;
+    Batch.initRayTakeoff=initRayTakeoff;
+    Batch.TS=(P[TS]!=0);Batch.TD=(P[TD]!=0);Batch.RS=(P[RS]!=0);Batch.RD=(P[RD]!=0);
+    Batch.nThread=(size_t)P[nThread];
+    Batch.DebugInfo=(P[DebugInfo]!=0);
+    Batch.StopAtSurface=(P[StopAtSurface]!=0);
+    Batch.UseLegCache=(P[UseLegCache]!=0);
+    Batch.LegCacheRaypInc=P[LegCacheRaypInc];
+    Batch.MergeRays=(P[MergeRays]!=0);
+    Batch.MergeTolerance=P[MergeTolerance];
+    Batch.Wavefront=(P[Wavefront]!=0);
+    Batch.BeamWidth=(size_t)P[BeamWidth];
+    Batch.RayBundle=(size_t)P[RayBundle];
+    Batch.LayerIntegrator=(int)P[LayerIntegrator];
+    Batch.TwoPass=(size_t)P[TwoPass];
+    Batch.OutputPrecision=(int)P[OutputPrecision];
+
+    // Adaptive fans are refined first, their rays follow the input rays.
+    for (size_t i=0;i<fans.size();++i) {
+        const auto &F=fans[i];
+        auto takeoffs=tracer.fan(Batch,F,P[FanTolerance],P[FanMinStep]);
+        cout << "Adaptive fan " << i+1 << ": " << takeoffs.size() << " rays." << '\n';
+        for (const auto &item: takeoffs) {
+            Batch.initRaySteps.push_back(F.Steps);
+            Batch.initRayComp.push_back(F.Comp);
+            Batch.initRayColor.push_back(F.Color);
+            Batch.initRayTheta.push_back(F.Theta);
+            Batch.initRayDepth.push_back(F.Depth);
+            Batch.initRayTakeoff.push_back(item);
+        }
     }
-    int *RegionN=(int *)malloc(regionProperties.size()*sizeof(int));
-    for (size_t i=0;i<regionProperties.size();++i) RegionN[i]=0;
-
 
-    PreprocessAndRun(
-        initRaySteps,initRayComp,initRayColor,
-        initRayTheta,initRayDepth,initRayTakeoff,gridDepth1,gridDepth2,gridInc,specialDepths,
-        Deviation,regionProperties,regionPolygonsTheta,regionPolygonsDepth,
-        P[RectifyLimit],(P[TS]!=0),(P[TD]!=0),(P[RS]!=0),(P[RD]!=0),(size_t)P[nThread],(P[DebugInfo]!=0),(P[StopAtSurface]!=0),
-        branches,potentialSize,
-        ReachSurfaces,ReachSurfacesSize,RayInfo,RayInfoSize,RegionN,RegionsTheta,RegionsRadius,RaysTheta,RaysN,RaysRadius,Observer);
+    auto Out=tracer.trace(Batch);
+    const auto &BeamDiscarded=Out.BeamDiscarded;
+    const auto &Regions=tracer.regions();
 
 
     // Outputs.
     // If I/O changes, change this part.
 
-    ofstream fpout(P[ReceiverFileName]);
-    fpout << "<Takeoff> <Rayp> <Incident> <Dist> <TravelTime> <DispAmp> <RemainingLegs> <rayTurns> <WaveTypeTrain> <RayTrain>" << '\n';
-    for (size_t i=0;i<potentialSize;++i)
-        if (ReachSurfacesSize[i]!=0)
-            fpout << string(ReachSurfaces[i]) << '\n';
-    fpout.close();
+    // Beam search: how much amplitude (sum of |DispAmp|) was dropped in each generation.
+    if (P[BeamWidth]>0) {
+        cout << "Beam search (width " << P[BeamWidth] << "), discarded |DispAmp| / total |DispAmp| per generation:" << '\n';
+        double discarded=0;
+        for (size_t i=0;i<BeamDiscarded.size();++i) {
+            discarded+=BeamDiscarded[i].first;
+            cout << "    generation " << i+1 << ": " << BeamDiscarded[i].first << " / " << BeamDiscarded[i].second << '\n';
+        }
+        cout << "    total discarded: " << discarded << endl;
+    }
+
+    // (with "TravelTime", the <TravelTime> column is replaced by these values)
+    auto writeReceivers=[&P](const string &file, const TraceResult &Out, const vector<double> *TravelTime){
+        TextWriter fpout(file,(int)P[OutputPrecision]);
+        fpout << "<Takeoff> <Rayp> <Incident> <Dist> <TravelTime> <DispAmp> <RemainingLegs> <rayTurns> <WaveTypeTrain> <RayTrain>"
+              << (P[MergeRays]!=0?" <MergedTrains>":"") << '\n';
+        for (size_t i=0;i<Out.ReachSurfaces.size();++i) {
+            if (Out.ReachSurfaces[i].empty()) continue;
+            if (TravelTime==nullptr) {
+                fpout << Out.ReachSurfaces[i] << '\n';
+                continue;
+            }
+            stringstream ss(Out.ReachSurfaces[i]);
+            vector<string> fields{istream_iterator<string>(ss),istream_iterator<string>()};
+            for (size_t j=0;j<fields.size();++j) {
+                if (j==4) fpout << (*TravelTime)[i];
+                else fpout << fields[j];
+                fpout << (j+1==fields.size()?'\n':' ');
+            }
+        }
+        fpout.close();
+    };
+    writeReceivers(P[ReceiverFileName],Out,nullptr);
+
+    // Receiver gather: arrivals of each source and ray lineage interpolated at the stations.
+    if (!stationDists.empty()) {
+        TextWriter fpout(P[GatherFileName],(int)P[OutputPrecision]);
+        fpout << "<Station> <SourceTheta> <SourceDepth> <Takeoff> <Rayp> <Incident> <Dist> <TravelTime> <DispAmp> <WaveTypeTrain>" << '\n';
+        for (const auto &item: ReceiverGather(Batch,Out,stationDists)) {
+            const auto &A=item.Arrival;
+            fpout << stationNames[item.Station] << " " << item.SourceTheta << " " << item.SourceDepth << " " << A.Takeoff << " "
+                  << A.RayP << " " << A.Inc << " " << A.Dist << " " << A.TravelTime << " " << A.Amp << " " << A.Phase << '\n';
+        }
+        fpout.close();
+    }
 
     // Output valid part ray paths.
-    if (P[RayFilePrefix]!="NONE") {
-        for (size_t i=0;i<potentialSize;++i) {
-            if (RayInfoSize[i]==0) continue;
-
-            ofstream fpout(P[RayFilePrefix]+to_string(i+1));
-            fpout << "> " << string(RayInfo[i]) << '\n';
-            for (int j=0;j<RaysN[i];++j)
-                fpout << RaysTheta[i][j] << " " << RaysRadius[i][j] << '\n';
+    // "gmt": one multi-segment file, each header carries the b01 pen (unit line thickness) and the ray number (-L),
+    // followed by the path header.
+    if (P[RayFilePrefix]!="NONE" && P[RayFileFormat]=="binary") SaveRayPaths(P[RayFilePrefix]+"paths.bin",Out);
+    else if (P[RayFilePrefix]!="NONE" && P[RayFileFormat]=="gmt") {
+        const vector<string> colors{"","darkred","green","lightblue","purple","lightgreen","cyan","darkblue","gold","yellow"};
+        TextWriter fpout(P[RayFilePrefix]+"paths.gmt",(int)P[OutputPrecision]);
+        for (size_t i=0;i<Out.RayInfo.size();++i) {
+            if (Out.RayInfo[i].empty()) continue;
+
+            const auto &H=Out.PathHeaders[i];
+            string color=(H.Color==0?(H.Type==0?"blue":"red"):(H.Color>0 && H.Color<10?colors[H.Color]:"black"));
+            if (H.Amp<0) color="darkgreen";
+            fpout << "> -W" << max(0.1,sqrt(fabs(H.Amp))) << "p," << color << " -L" << i+1 << " " << Out.RayInfo[i] << '\n';
+            for (size_t j=0;j<Out.RaysTheta[i].size();++j)
+                fpout << Out.RaysTheta[i][j] << ' ' << Out.RaysRadius[i][j] << '\n';
+        }
+        fpout.close();
+    }
+    else if (P[RayFilePrefix]!="NONE") {
+        for (size_t i=0;i<Out.RayInfo.size();++i) {
+            if (Out.RayInfo[i].empty()) continue;
+
+            TextWriter fpout(P[RayFilePrefix]+to_string(i+1),(int)P[OutputPrecision]);
+            fpout << "> " << Out.RayInfo[i] << '\n';
+            for (size_t j=0;j<Out.RaysTheta[i].size();++j)
+                fpout << Out.RaysTheta[i][j] << ' ' << Out.RaysRadius[i][j] << '\n';
             fpout.close();
         }
     }
@@ -217,7 +506,7 @@ int main(int argc, char **argv){
     // Output.
     // For plotting: 1D reference property deviation depths.
     if (!Deviation.empty() && P[PolygonFilePrefix]!="NONE"){
-        ofstream fpout(P[PolygonFilePrefix]+"0");
+        TextWriter fpout(P[PolygonFilePrefix]+"0",(int)P[OutputPrecision]);
         for (const auto &item:Deviation) {
             fpout << ">\n";
             for (double t=0;t<360;t=t+0.1) fpout << t << " " << _RE-item[0] << '\n';
@@ -229,39 +518,100 @@ int main(int argc, char **argv){
 
     // Output rectified regions.
     if (P[PolygonFilePrefix]!="NONE"){
-        for (size_t i=0;i<regionProperties.size();++i) {
-            FILE *fpout=fopen((P[PolygonFilePrefix]+to_string(i+1)).c_str(),"w");
-            for (int j=0;j<RegionN[i];++j)
-                fprintf(fpout,"%.7e %.7e\n",RegionsTheta[i][j],RegionsRadius[i][j]);
-            fclose(fpout);
+        for (size_t i=1;i<Regions.size();++i) {
+            TextWriter fpout(P[PolygonFilePrefix]+to_string(i),(P[OutputPrecision]==0?0:7));
+            fpout.Format=chars_format::scientific;
+            for (const auto &item:Regions[i])
+                fpout << item.first << ' ' << item.second << '\n';
+            fpout.close();
         }
     }
 
-    // Free spaces.
-    for (size_t i=0;i<potentialSize;++i){
-        if (RaysN[i]!=0) {
-            free(RaysTheta[i]);
-            free(RaysRadius[i]);
-        }
-        if (ReachSurfacesSize[i]!=0) free(ReachSurfaces[i]);
-        if (RayInfoSize[i]!=0) free(RayInfo[i]);
+    // Two-point tracing: arrivals of each target phase landing at the target distance.
+    if (!targets.empty()) {
+        auto Lines=tracer.solve(Batch,targets,(size_t)P[TwoPointScan],P[TwoPointTolerance]);
+        TextWriter fpout(P[TwoPointFileName],(int)P[OutputPrecision]);
+        fpout << "<Name> <Target> <Misfit> <Takeoff> <Rayp> <Incident> <Dist> <TravelTime> <DispAmp> <RemainingLegs> <rayTurns> <WaveTypeTrain> <RayTrain>"
+              << (P[MergeRays]!=0?" <MergedTrains>":"") << '\n';
+        for (size_t i=0;i<targets.size();++i)
+            for (const auto &item: Lines[i]) {
+                fpout << targets[i].Name << " " << targets[i].Distance << " " << item.first << " " << item.second << '\n';
+                if (fabs(item.first)>P[TwoPointTolerance])
+                    cout << "Two-point target " << targets[i].Name << " not converged: closest arrival misfit " << item.first << " deg." << '\n';
+            }
+        fpout.close();
     }
-    for (size_t i=0;i<regionProperties.size();++i) {
-        if (RegionN[i]!=0) {
-            free(RegionsTheta[i]);
-            free(RegionsRadius[i]);
-        }
+
+    // Travel-time table. (binary, see "TravelTimeTable")
+    if (!table.Phases.empty()) {
+        tracer.tabulate(Batch,tableComps,tableSteps,P[TableTakeoff1],P[TableTakeoff2],P[TableTakeoffInc],table);
+        SaveTravelTimeTable(P[TableFileName],table);
+    }
+
+    // Eikonal first arrivals, sources solved in parallel (one thread each).
+    // "<EikonalFilePrefix><Name>": surface times; "<EikonalFilePrefix><Name>.grid": the whole grid (binary,
+    // 2 uint64 {nRadius, nTheta}, 2 double {RadiusInc, ThetaInc}, then float32 times [radius][theta]).
+    if (!eikonalSources.empty()) {
+        atomic<size_t> next(0);
+        vector<thread> allThreads;
+        for (size_t t=0;t<(size_t)P[nThread];++t)
+            allThreads.push_back(thread([&](){
+                for (size_t k=next.fetch_add(1);k<eikonalSources.size();k=next.fetch_add(1)) {
+                    const auto &E=eikonalSources[k];
+                    auto T=tracer.eikonal(E.Theta,E.Depth,E.IsP,P[EikonalThetaInc],P[EikonalRadiusInc]);
+                    size_t nRadius=T.size(),nTheta=T[0].size();
+                    double dTheta=360.0/nTheta;
+
+                    TextWriter fpout(P[EikonalFilePrefix]+E.Name,(int)P[OutputPrecision]);
+                    fpout << "<Dist> <TravelTime>" << '\n';
+                    for (size_t i=0;i<nTheta;++i)
+                        if (!std::isinf(T[0][i])) fpout << Lon2180(i*dTheta-E.Theta) << " " << T[0][i] << '\n';
+                    fpout.close();
+
+                    vector<uint64_t> header{nRadius,nTheta};
+                    vector<double> axes{P[EikonalRadiusInc],dTheta};
+                    vector<float> data;
+                    for (const auto &item: T) data.insert(data.end(),item.begin(),item.end());
+                    ofstream fpgrid(P[EikonalFilePrefix]+E.Name+".grid",ios::binary);
+                    fpgrid.write((const char *)header.data(),header.size()*sizeof(uint64_t));
+                    fpgrid.write((const char *)axes.data(),axes.size()*sizeof(double));
+                    fpgrid.write((const char *)data.data(),data.size()*sizeof(float));
+                    fpgrid.close();
+                }
+            }));
+        for (auto &t: allThreads) t.join();
+    }
+
+    // Scenarios: share the preprocessed model, only the varied polygon is rebuilt.
+    // Scenarios are traced in parallel (one thread each), outputs are receiver files "<ReceiverFileName>_<Name>".
+    // With "PerturbThreshold", scenarios only changing properties get first-order travel times from the paths above,
+    // unless an arrival has a leg in a region whose velocity changed more than the threshold.
+    if (!scenarios.empty()) {
+        if (P[PerturbThreshold]<=0) Out=TraceResult();
+        Batch.nThread=1;
+        atomic<size_t> next(0);
+        vector<thread> allThreads;
+        for (size_t t=0;t<(size_t)P[nThread];++t)
+            allThreads.push_back(thread([&](){
+                for (size_t k=next.fetch_add(1);k<scenarios.size();k=next.fetch_add(1)) {
+                    const auto &S=scenarios[k];
+                    if (!S.Reshaped && P[PerturbThreshold]>0) {
+                        auto properties=regionProperties;
+                        properties[S.Region-1]=S.Properties;
+                        vector<bool> refresh;
+                        auto tt=tracer.perturb(Out,properties,P[PerturbThreshold],refresh);
+                        if (find(refresh.begin(),refresh.end(),true)==refresh.end()) {
+                            writeReceivers(P[ReceiverFileName]+"_"+S.Name,Out,&tt);
+                            continue;
+                        }
+                    }
+                    vector<pair<double,double>> rectified;
+                    auto out=tracer.trace(Batch,S.Region,S.Properties,S.PolygonTheta,S.PolygonDepth,rectified);
+                    writeReceivers(P[ReceiverFileName]+"_"+S.Name,out,nullptr);
+                }
+            }));
+        for (auto &t: allThreads) t.join();
     }
-    free(RegionN);
-    free(RegionsTheta);
-    free(RegionsRadius);
-    free(RaysN);
-    free(RaysTheta);
-    free(RaysRadius);
-    free(ReachSurfacesSize);
-    free(ReachSurfaces);
-    free(RayInfoSize);
-    free(RayInfo);
 
     return 0;
 }
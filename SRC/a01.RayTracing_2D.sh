@@ -11,6 +11,9 @@ echo ""
 echo "--> `basename $0` is running."
 ! [ ${PolygonFilePrefix} = "NONE" ] && PolygonFilePrefix=${WORKDIR}/${PolygonFilePrefix} && rm -f ${PolygonFilePrefix}*
 ! [ ${RayFilePrefix} = "NONE" ] && RayFilePrefix=${WORKDIR}/${RayFilePrefix} && rm -f ${RayFilePrefix}*
+! [ ${EikonalFilePrefix} = "NONE" ] && EikonalFilePrefix=${WORKDIR}/${EikonalFilePrefix} && rm -f ${EikonalFilePrefix}*
+! [ ${TableFileName} = "NONE" ] && TableFileName=${WORKDIR}/${TableFileName}
+! [ ${ModelCachePrefix} = "NONE" ] && [ ${ModelCachePrefix:0:1} != "/" ] && ModelCachePrefix=${WORKDIR}/${ModelCachePrefix}
 trap "rm -f ${WORKDIR}/tmpfile*$$ ${WORKDIR}/*_${RunNumber}; exit 1" SIGINT
 
 # ==============================================
@@ -19,7 +22,7 @@ trap "rm -f ${WORKDIR}/tmpfile*$$ ${WORKDIR}/*_${RunNumber}; exit 1" SIGINT
 
 # C++ code.
 
-${EXECDIR}/TraceIt.out 7 8 1 << EOF
+${EXECDIR}/TraceIt.out 16 21 21 << EOF
 ${DebugInfo}
 ${TS}
 ${TD}
@@ -27,6 +30,15 @@ ${RS}
 ${RD}
 ${StopAtSurface}
 ${nThread}
+${UseLegCache}
+${MergeRays}
+${Wavefront}
+${BeamWidth}
+${RayBundle}
+${LayerIntegrator}
+${TwoPass}
+${TwoPointScan}
+${OutputPrecision}
 ${WORKDIR}/tmpfile_InputRays_${RunNumber}
 ${WORKDIR}/tmpfile_LayerSetting_${RunNumber}
 ${WORKDIR}/tmpfile_KeyDepths_${RunNumber}
@@ -35,7 +47,40 @@ ${WORKDIR}/tmpfile_Polygons_${RunNumber}
 ${WORKDIR}/${ReceiverFileName}
 ${PolygonFilePrefix}
 ${RayFilePrefix}
+${ModelCachePrefix}
+${WORKDIR}/tmpfile_Scenarios_${RunNumber}
+${WORKDIR}/tmpfile_TwoPoint_${RunNumber}
+${WORKDIR}/${TwoPointFileName}
+${WORKDIR}/tmpfile_Fans_${RunNumber}
+${WORKDIR}/tmpfile_TablePhases_${RunNumber}
+${TableFileName}
+${WORKDIR}/tmpfile_Stations_${RunNumber}
+${WORKDIR}/${GatherFileName}
+${WORKDIR}/tmpfile_EikonalSources_${RunNumber}
+${EikonalFilePrefix}
+${WORKDIR}/tmpfile_SmoothAnomalies_${RunNumber}
+${RayFileFormat}
 ${RectifyLimit}
+${LegCacheRaypInc}
+${MergeTolerance}
+${AdaptiveGridMargin}
+${AdaptiveGridInc}
+${PerturbThreshold}
+${TwoPointTolerance}
+${FanTolerance}
+${FanMinStep}
+${TableTheta}
+${TableDepth1}
+${TableDepth2}
+${TableDepthInc}
+${TableTakeoff1}
+${TableTakeoff2}
+${TableTakeoffInc}
+${TableDist1}
+${TableDist2}
+${TableDistInc}
+${EikonalThetaInc}
+${EikonalRadiusInc}
 EOF
 
 [ $? -ne 0 ] && echo "C++ code Failed ..." && rm -f tmpfile*$$ && exit 1
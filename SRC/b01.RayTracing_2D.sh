@@ -36,6 +36,7 @@ color[9]=yellow
 # Check Calculation
 ls ${WORKDIR}/${RayFilePrefix}* >/dev/null 2>&1
 [ $? -ne 0 ] && echo "    !=> In `basename $0`: Run a01 first ..." && exit 1
+[ ${RayFileFormat} = "binary" ] && echo "    !=> In `basename $0`: Plotting needs RayFileFormat text or gmt ..." && exit 1
 RE="6371.0"
 
 # Plot.
@@ -84,7 +85,20 @@ EOF
 EOF
 
     # plot ray path.
-    for file in `ls ${WORKDIR}/${RayFilePrefix}*`
+    # gmt stream: pens are in the segment headers (for unit line thickness), rescale them by DispAmp if needed.
+    if [ ${RayFileFormat} = "gmt" ]
+    then
+        if [ `echo "${LineThickness}==1" | bc` -eq 1 ] && [ ${LineThicknessUseAmp} -eq 1 ]
+        then
+            gmt psxy ${WORKDIR}/${RayFilePrefix}paths.gmt ${PROJ} ${REG} -O -K >> ${OUTFILE}
+        else
+            awk -v T=${LineThickness} -v U=${LineThicknessUseAmp} '
+                /^>/ {A=($10<0?-$10:$10); W=sqrt(A)*T; if (W<0.1) W=0.1; if (U!=1) W=0.5; sub(/-W[^p]*p/,"-W"W"p")}
+                {print}' ${WORKDIR}/${RayFilePrefix}paths.gmt | gmt psxy ${PROJ} ${REG} -O -K >> ${OUTFILE}
+        fi
+    fi
+
+    for file in `[ ${RayFileFormat} = "text" ] && ls ${WORKDIR}/${RayFilePrefix}*`
     do
 
         # Plot choice. Rays with segments larger than 90 degree is not plotted.
@@ -111,7 +125,7 @@ EOF
 
 #     gmt psxy /Users/shuleyu/Documents/Research/t063.updateTomography.200304/taup_path.gmt ${PROJ} ${REG} -W0.3p,black -O -K >> ${OUTFILE}
 
-    for file in `ls ${WORKDIR}/${RayFilePrefix}*`
+    for file in `[ ${RayFileFormat} = "text" ] && ls ${WORKDIR}/${RayFilePrefix}*`
     do
         # Plot choice. Rays with segments larger than 90 degree is not plotted.
 #         FinalDist=`tail -n 1 ${file} | awk '{if ($1>90) print 0; else print 1}'`
@@ -126,10 +140,22 @@ EOF
 ${Position} ${TargetR} ${file##*_}
 EOF
 
-        gmt pstext ${PROJ} ${REG} -F+jCM+f5p -N -O -K >> ${OUTFILE} << EOF
-EOF
+        gmt pstext tmpfile_text_$$ ${PROJ} ${REG} -F+jCM+f5p -N -O -K >> ${OUTFILE}
     done
 
+    # gmt stream: same labels, the ray number is in the segment header (-L).
+    if [ ${RayFileFormat} = "gmt" ]
+    then
+        awk 'function label(  j,k,T) {
+                 if (n==0) return;
+                 T=R[1]+(R[n]-R[1])*0.1; k=1;
+                 for (j=2;j<=n;++j) if ((R[j]-T)^2<(R[k]-T)^2) k=j;
+                 print Theta[k],T,L}
+             /^>/ {label(); n=0; for (j=2;j<=NF;++j) if ($j ~ /^-L/) L=substr($j,3); next}
+             {++n; Theta[n]=$1; R[n]=$2}
+             END {label()}' ${WORKDIR}/${RayFilePrefix}paths.gmt | gmt pstext ${PROJ} ${REG} -F+jCM+f5p -N -O -K >> ${OUTFILE}
+    fi
+
     # plot info at surface.
 
     if [ `echo "${PLOTSIZE}>10" | bc` -eq 1 ]